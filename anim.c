@@ -0,0 +1,211 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "anim.h"
+
+static int compare_keys(const void *a, const void *b)
+{
+    const struct anim_key_t *ka = a, *kb = b;
+    if(ka->target != kb->target)
+        return ka->target < kb->target ? -1 : 1;
+    return (ka->frame > kb->frame) - (ka->frame < kb->frame);
+}
+
+/* one line, with any comment already cut off; returns what was wrong
+ * with it, or NULL */
+static const char *parse_line(struct anim_t *anim, int *cap, const char *line)
+{
+    char word[64];
+    int used;
+    if(sscanf(line, "%63s%n", word, &used) != 1)
+        return NULL;
+    const char *rest = line + used;
+
+    struct anim_key_t key;
+    double *v = key.v;
+    if(!strcmp(word, "frames"))
+    {
+        if(sscanf(rest, "%d", &anim->n_frames) != 1 || anim->n_frames < 1)
+            return "expected frames n";
+        return NULL;
+    }
+    else if(!strcmp(word, "camera"))
+    {
+        if(sscanf(rest, "%d %lf %lf %lf %lf %lf %lf",
+                  &key.frame, v, v + 1, v + 2, v + 3, v + 4, v + 5) != 7)
+            return "expected camera frame x y z dx dy dz";
+        key.target = ANIM_CAMERA;
+    }
+    else if(!strcmp(word, "instance"))
+    {
+        if(sscanf(rest, "%d %d %lf %lf %lf %lf %lf %lf %lf", &key.frame, &key.target,
+                  v, v + 1, v + 2, v + 3, v + 4, v + 5, v + 6) != 9)
+            return "expected instance frame k x y z rx ry rz scale";
+        if(key.target < 0)
+            return "no such instance";
+        if(v[6] == 0)
+            return "instance scale can't be 0";
+        for(int a = 3; a < 6; ++a)
+            v[a] *= M_PI / 180;
+    }
+    else
+        return "unknown item";
+
+    if(anim->n_keys == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 16;
+        anim->keys = realloc(anim->keys, sizeof(struct anim_key_t) * *cap);
+    }
+    anim->keys[anim->n_keys++] = key;
+    return NULL;
+}
+
+bool load_anim(const char *path, struct anim_t *anim)
+{
+    FILE *f = fopen(path, "r");
+    if(!f)
+    {
+        perror(path);
+        return false;
+    }
+
+    memset(anim, 0, sizeof(*anim));
+    int cap = 0;
+    char line[4096];
+    bool ok = true;
+    for(int line_no = 1; ok && fgets(line, sizeof(line), f); ++line_no)
+    {
+        char *hash = strchr(line, '#');
+        if(hash)
+            *hash = '\0';
+        const char *err = parse_line(anim, &cap, line);
+        if(err)
+        {
+            fprintf(stderr, "%s:%d: %s\n", path, line_no, err);
+            ok = false;
+        }
+    }
+    if(ferror(f))
+    {
+        perror(path);
+        ok = false;
+    }
+    fclose(f);
+    if(ok && !anim->n_frames)
+    {
+        fprintf(stderr, "%s: no frames line\n", path);
+        ok = false;
+    }
+    if(!ok)
+    {
+        free_anim(anim);
+        return false;
+    }
+
+    qsort(anim->keys, anim->n_keys, sizeof(struct anim_key_t), compare_keys);
+
+    /* scales are interpolated linearly, so one that changed sign would
+     * pass through 0 and leave nothing to invert */
+    for(int i = 1; i < anim->n_keys; ++i)
+    {
+        const struct anim_key_t *a = anim->keys + i - 1, *b = anim->keys + i;
+        if(b->target != ANIM_CAMERA && a->target == b->target && (a->v[6] < 0) != (b->v[6] < 0))
+        {
+            fprintf(stderr, "%s: instance %d's scale changes sign between frames %d and %d\n",
+                    path, b->target, a->frame, b->frame);
+            free_anim(anim);
+            return false;
+        }
+    }
+
+    anim->max_instance = -1;
+    for(int i = 0; i < anim->n_keys; ++i)
+    {
+        int target = anim->keys[i].target;
+        if(target != ANIM_CAMERA && (i == 0 || anim->keys[i - 1].target != target))
+        {
+            ++anim->n_instances;
+            anim->max_instance = target;
+        }
+    }
+    return true;
+}
+
+void free_anim(struct anim_t *anim)
+{
+    free(anim->keys);
+    anim->keys = NULL;
+    anim->n_keys = 0;
+}
+
+/* the keys [first, last) of one target either side of frame, and how
+ * far between them it is */
+static double bracket(const struct anim_key_t *keys, int first, int last, int frame,
+                      const struct anim_key_t **a, const struct anim_key_t **b)
+{
+    int i = first;
+    while(i + 1 < last && keys[i + 1].frame <= frame)
+        ++i;
+    *a = *b = keys + i;
+    if(frame <= keys[i].frame || i + 1 == last)
+        return 0;
+    *b = keys + i + 1;
+    return (double)(frame - (*a)->frame) / ((*b)->frame - (*a)->frame);
+}
+
+/* end of the run of keys starting at first */
+static int target_end(const struct anim_t *anim, int first)
+{
+    int last = first + 1;
+    while(last < anim->n_keys && anim->keys[last].target == anim->keys[first].target)
+        ++last;
+    return last;
+}
+
+void anim_camera(const struct anim_t *anim, int frame, struct camera_t *cam)
+{
+    /* the camera sorts first */
+    if(!anim->n_keys || anim->keys[0].target != ANIM_CAMERA)
+        return;
+    const struct anim_key_t *a, *b;
+    double s = bracket(anim->keys, 0, target_end(anim, 0), frame, &a, &b);
+
+    vec3 pos[2];
+    vector dir[2];
+    for(int i = 0; i < 2; ++i)
+    {
+        const double *v = (i ? b : a)->v;
+        pos[i] = vec3_make(v[0], v[1], v[2]);
+        dir[i] = camera_direction(vec3_make(v[3], v[4], v[5]));
+        vect_to_sph(&dir[i]);
+    }
+    cam->origin = vec3_add(pos[0], vec3_mul(vec3_sub(pos[1], pos[0]), s));
+    cam->direction = dir[0];
+    cam->direction.sph.r += s * (dir[1].sph.r - dir[0].sph.r);
+    cam->direction.sph.elevation += s * (dir[1].sph.elevation - dir[0].sph.elevation);
+    cam->direction.sph.azimuth += s * remainder(dir[1].sph.azimuth - dir[0].sph.azimuth, 2 * M_PI);
+}
+
+int anim_instances(const struct anim_t *anim, int frame, struct anim_move_t *out)
+{
+    int n = 0;
+    for(int first = 0; first < anim->n_keys; first = target_end(anim, first))
+    {
+        if(anim->keys[first].target == ANIM_CAMERA)
+            continue;
+        const struct anim_key_t *a, *b;
+        double s = bracket(anim->keys, first, target_end(anim, first), frame, &a, &b);
+        double v[7];
+        for(int i = 0; i < 7; ++i)
+            v[i] = a->v[i] + s * (b->v[i] - a->v[i]);
+
+        struct instance_t inst;
+        instance_transform(&inst, vec3_make(v[0], v[1], v[2]), vec3_make(v[3], v[4], v[5]), v[6]);
+        out[n].instance = a->target;
+        memcpy(out[n].xform, inst.xform, sizeof(inst.xform));
+        ++n;
+    }
+    return n;
+}
@@ -0,0 +1,55 @@
+#ifndef ANIM_H
+#define ANIM_H
+
+#include <stdbool.h>
+
+#include "camera.h"
+#include "scene.h"
+
+/* keyframes for rendering a run of frames in one go, one per line
+ * with '#' to the end of a line a comment; angles are in degrees:
+ *
+ *   frames n
+ *   camera frame  x y z  dx dy dz
+ *   instance frame k  x y z  rx ry rz  scale
+ *
+ * instance k is the k-th instance line of the scene (from 0), and its
+ * keys replace its transform outright. between keys everything moves
+ * linearly, the camera's direction by azimuth and elevation the short
+ * way round; before the first key and after the last it holds still.
+ * an instance's scale can't change sign from key to key, as it would
+ * go through 0 on the way. the camera keeps the scene's field of view */
+struct anim_key_t {
+    int target;  /* ANIM_CAMERA or an instance */
+    int frame;
+    double v[7]; /* as on the line, angles in radians */
+};
+
+#define ANIM_CAMERA -1
+
+struct anim_t {
+    int n_frames;
+    struct anim_key_t *keys; /* by target, then frame */
+    int n_keys;
+    int n_instances;  /* that have keys */
+    int max_instance; /* highest with keys, -1 if none */
+};
+
+/* where an animated instance is at some frame */
+struct anim_move_t {
+    int instance;
+    scalar xform[3][4];
+};
+
+/* on failure a message goes to stderr and false is returned */
+bool load_anim(const char *path, struct anim_t *anim);
+void free_anim(struct anim_t *anim);
+
+/* cam at frame; left alone if the camera has no keys */
+void anim_camera(const struct anim_t *anim, int frame, struct camera_t *cam);
+
+/* every animated instance's transform at frame, in out, which has room
+ * for anim->n_instances; returns how many */
+int anim_instances(const struct anim_t *anim, int frame, struct anim_move_t *out);
+
+#endif
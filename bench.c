@@ -0,0 +1,465 @@
+/* headless benchmark: renders a set of deterministic scenes at every
+ * thread count from 1 up to one per CPU and prints the ray rates and
+ * frame times as CSV, one line per scene and thread count. for the
+ * lights scenes the primitives column counts lights, and for the
+ * instances scenes copies of one mesh. first it checks the light
+ * cutoff against shading with every light, and fails if they disagree
+ *
+ * cc -O2 -o bench bench.c render.c scene.c packet.c camera.c vector.c framebuffer.c -lm -lpthread
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "camera.h"
+#include "packet.h"
+#include "render.h"
+#include "scene.h"
+
+#define WIDTH 320
+#define HEIGHT 240
+
+/* each configuration renders for at least this long, and at least
+ * MIN_FRAMES frames */
+#define MIN_SECS .5
+#define MIN_FRAMES 3
+
+/* generated scenes fill this box in front of the camera */
+#define BOX_MIN_X 2
+#define BOX_MAX_X 42
+#define BOX_MIN_Y 0
+#define BOX_MAX_Y 10
+#define BOX_MIN_Z -25
+#define BOX_MAX_Z 15
+
+enum { CLASSIC, SPHERES, TRIS, LIGHTS, INSTANCES };
+
+static const char *kind_names[] = { "classic", "spheres", "tris", "lights", "instances" };
+
+/* the lights scenes are this many spheres lit by 1 to MAX_LIGHTS lights */
+#define LIGHTS_SPHERES 1000
+#define MAX_LIGHTS 10000
+
+/* the mesh the instances scenes copy: this many triangles in a unit cube */
+#define INSTANCE_TRIS 1000
+
+/* xorshift32, so the scenes come out the same on every libc */
+static unsigned rng_state;
+
+static scalar rand_range(scalar lo, scalar hi)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return lo + (hi - lo) * (rng_state / 4294967296.);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* the five objects and light main.c renders */
+static int classic_scene(struct object_t *objs, struct light_t *light)
+{
+    objs[0].type = SPHERE;
+    objs[0].sphere.center = vec3_make(1, 1, 0);
+    objs[0].sphere.radius = 1;
+    objs[0].color = (struct rgb_t){0, 0, 0xff};
+    objs[0].specularity = 0xf0;
+
+    objs[1].type = SPHERE;
+    objs[1].sphere.center = vec3_make(-1, 1, 0);
+    objs[1].sphere.radius = 1;
+    objs[1].color = (struct rgb_t){0xff, 0, 0};
+    objs[1].specularity = 40;
+
+    objs[2].type = SPHERE;
+    objs[2].sphere.center = vec3_make(-3, 1, 0);
+    objs[2].sphere.radius = 1;
+    objs[2].color = (struct rgb_t){0xff, 0xff, 0xff};
+    objs[2].specularity = 0xf0;
+
+    objs[3].type = PLANE;
+    objs[3].plane.point = vec3_make(0, 0, 0);
+    objs[3].plane.normal = vec3_make(0, 1, 0);
+    objs[3].color = (struct rgb_t) {0, 0xff, 0};
+    objs[3].specularity = 0;
+
+    objs[4].type = TRI;
+    objs[4].tri.points[0] = vec3_make(5, 0, 0);
+    objs[4].tri.points[1] = vec3_make(5, 5, 0);
+    objs[4].tri.points[2] = vec3_make(0, 5, 0);
+    objs[4].color = (struct rgb_t) {0xff, 0, 0};
+    objs[4].specularity = 0x30;
+
+    light->position = vec3_make(5, 10, -5);
+    light->intensity = 200;
+    return 5;
+}
+
+/* n spheres or triangles scattered through the box over a ground
+ * plane, sized so the box is about as full whatever n is */
+static int random_scene(struct object_t *objs, struct light_t *light, int kind, int n)
+{
+    rng_state = 2463534242u ^ n;
+
+    scalar volume = (BOX_MAX_X - BOX_MIN_X) * (BOX_MAX_Y - BOX_MIN_Y) * (BOX_MAX_Z - BOX_MIN_Z);
+    scalar spacing = cbrt(volume / n);
+
+    for(int i = 0; i < n; ++i)
+    {
+        struct object_t *obj = objs + i;
+        vec3 c = vec3_make(rand_range(BOX_MIN_X, BOX_MAX_X),
+                           rand_range(BOX_MIN_Y, BOX_MAX_Y),
+                           rand_range(BOX_MIN_Z, BOX_MAX_Z));
+        if(kind == SPHERES)
+        {
+            obj->type = SPHERE;
+            obj->sphere.center = c;
+            obj->sphere.radius = spacing * rand_range(.1, .4);
+        }
+        else
+        {
+            obj->type = TRI;
+            for(int j = 0; j < 3; ++j)
+                obj->tri.points[j] = vec3_add(c, vec3_make(spacing * rand_range(-.5, .5),
+                                                           spacing * rand_range(-.5, .5),
+                                                           spacing * rand_range(-.5, .5)));
+        }
+        obj->color = (struct rgb_t) { rand_range(0, 256), rand_range(0, 256), rand_range(0, 256) };
+        obj->specularity = rand_range(0, 256);
+    }
+
+    objs[n].type = PLANE;
+    objs[n].plane.point = vec3_make(0, 0, 0);
+    objs[n].plane.normal = vec3_make(0, 1, 0);
+    objs[n].color = (struct rgb_t) {0x80, 0x80, 0x80};
+    objs[n].specularity = 0x80;
+
+    light->position = vec3_make(20, 30, -5);
+    light->intensity = 2000;
+    return n + 1;
+}
+
+static void random_mesh(struct mesh_t *mesh)
+{
+    rng_state = 362436069u;
+    scalar size = cbrt(1. / INSTANCE_TRIS);
+    mesh->n_verts = 3 * INSTANCE_TRIS;
+    mesh->n_tris = INSTANCE_TRIS;
+    mesh->verts = malloc(mesh->n_verts * sizeof(vec3));
+    mesh->indices = malloc(3 * mesh->n_tris * sizeof(int));
+    for(int i = 0; i < INSTANCE_TRIS; ++i)
+    {
+        vec3 c = vec3_make(rand_range(-.5, .5), rand_range(-.5, .5), rand_range(-.5, .5));
+        for(int j = 0; j < 3; ++j)
+        {
+            mesh->verts[3 * i + j] = vec3_add(c, vec3_make(size * rand_range(-.5, .5),
+                                                           size * rand_range(-.5, .5),
+                                                           size * rand_range(-.5, .5)));
+            mesh->indices[3 * i + j] = 3 * i + j;
+        }
+    }
+    mesh->color = (struct rgb_t) { 0xc0, 0x60, 0x20 };
+    mesh->specularity = 0x40;
+}
+
+/* n copies of the mesh through the box, turned about y and sized like
+ * random_scene()'s objects */
+static void random_instances(struct instance_t *insts, int n)
+{
+    rng_state = 1597334677u ^ n;
+    scalar volume = (BOX_MAX_X - BOX_MIN_X) * (BOX_MAX_Y - BOX_MIN_Y) * (BOX_MAX_Z - BOX_MIN_Z);
+    scalar spacing = cbrt(volume / n);
+    for(int i = 0; i < n; ++i)
+    {
+        vec3 c = vec3_make(rand_range(BOX_MIN_X, BOX_MAX_X),
+                           rand_range(BOX_MIN_Y, BOX_MAX_Y),
+                           rand_range(BOX_MIN_Z, BOX_MAX_Z));
+        insts[i].mesh = 0;
+        instance_transform(insts + i, c, vec3_make(0, rand_range(0, 2 * M_PI), 0), spacing * rand_range(.4, .8));
+        insts[i].color = (struct rgb_t) { rand_range(0, 256), rand_range(0, 256), rand_range(0, 256) };
+        insts[i].specularity = rand_range(0, 256);
+    }
+}
+
+/* n lights sharing the random scenes' light between them, scattered
+ * over the box */
+static void random_lights(struct light_t *lights, int n)
+{
+    rng_state = 88675123u ^ n;
+    for(int i = 0; i < n; ++i)
+    {
+        lights[i].position = vec3_make(rand_range(BOX_MIN_X, BOX_MAX_X),
+                                       rand_range(BOX_MAX_Y, 3 * BOX_MAX_Y),
+                                       rand_range(BOX_MIN_Z, BOX_MAX_Z));
+        lights[i].intensity = 2000. / n;
+    }
+}
+
+/* a floor of two big triangles, whose normals are far from unit
+ * length, under n lights dim enough not to wash it out */
+static int floor_scene(struct object_t *objs, struct light_t *lights, int n)
+{
+    static const scalar corners[2][3][2] = {
+        { { -50, -50 }, { 50, 50 }, { -50, 50 } },
+        { { -50, -50 }, { 50, -50 }, { 50, 50 } },
+    };
+    for(int i = 0; i < 2; ++i)
+    {
+        objs[i].type = TRI;
+        for(int j = 0; j < 3; ++j)
+            objs[i].tri.points[j] = vec3_make(corners[i][j][0], 0, corners[i][j][1]);
+        objs[i].color = (struct rgb_t) { 0xc0, 0xc0, 0xc0 };
+        objs[i].specularity = 0;
+    }
+
+    rng_state = 521288629u ^ n;
+    for(int i = 0; i < n; ++i)
+    {
+        lights[i].position = vec3_make(rand_range(-50, 50), rand_range(5, 20), rand_range(-50, 50));
+        lights[i].intensity = .1 / n;
+    }
+    return 2;
+}
+
+/* the light cutoff is only allowed to move a pixel by light_cutoff
+ * steps, which after rounding is one; returns false, saying where, if
+ * rendering with it and without it differ by more */
+static bool check_cutoff(struct render_pool_t *pool, const struct framebuffer_t *fb,
+                         const struct camera_view_t *view, const struct render_opts_t *opts)
+{
+    struct object_t objs[2];
+    struct light_t lights[50];
+    struct scene_t scene;
+    memset(&scene, 0, sizeof(scene));
+    scene.bg = (struct rgb_t) { 0x87, 0xce, 0xeb };
+    scene.ambient = .2;
+    scene.objects = objs;
+    scene.lights = lights;
+    scene.n_lights = 50;
+    scene.n_objects = floor_scene(objs, lights, scene.n_lights);
+    preprocess_scene(&scene);
+
+    struct render_opts_t all = *opts;
+    all.light_samples = 0;
+    all.light_cutoff = 0;
+    struct render_opts_t cut = all;
+    cut.light_cutoff = opts->light_cutoff;
+
+    struct framebuffer_t ref;
+    if(!fb_create(&ref, fb->w, fb->h, fb->format))
+        abort();
+    render_scene(pool, &ref, &scene, view, &all);
+    render_scene(pool, fb, &scene, view, &cut);
+
+    bool ok = true;
+    struct rgb_t a[WIDTH], b[WIDTH];
+    for(int y = 0; ok && y < fb->h; ++y)
+    {
+        fb_read_row(&ref, 0, y, fb->w, a);
+        fb_read_row(fb, 0, y, fb->w, b);
+        for(int x = 0; ok && x < fb->w; ++x)
+        {
+            if(abs(a[x].r - b[x].r) > 1 || abs(a[x].g - b[x].g) > 1 || abs(a[x].b - b[x].b) > 1)
+            {
+                fprintf(stderr, "light cutoff: pixel (%d, %d) is %d %d %d, but %d %d %d with every light\n",
+                        x, y, b[x].r, b[x].g, b[x].b, a[x].r, a[x].g, a[x].b);
+                ok = false;
+            }
+        }
+    }
+
+    fb_free(&ref);
+    free_scene(&scene);
+    return ok;
+}
+
+/* renders frames until both minimums are met and prints one CSV line;
+ * returns the time per frame */
+static double run(struct render_pool_t *pool, int n_threads, const struct framebuffer_t *fb,
+                  const struct scene_t *scene, const struct camera_view_t *view,
+                  const struct render_opts_t *opts, const char *name, int n_prims, double base)
+{
+    /* one untimed frame to fault in the framebuffer and warm the caches */
+    render_scene(pool, fb, scene, view, opts);
+
+    struct render_stats_t total, frame;
+    memset(&total, 0, sizeof(total));
+
+    int frames = 0;
+    double start = now(), elapsed;
+    do {
+        render_scene(pool, fb, scene, view, opts);
+        render_stats(pool, &frame);
+        total.primary += frame.primary;
+        total.shadow += frame.shadow;
+        total.reflections += frame.reflections;
+        ++frames;
+        elapsed = now() - start;
+    } while(frames < MIN_FRAMES || elapsed < MIN_SECS);
+
+    double per_frame = elapsed / frames;
+    long rays = total.primary + total.shadow + total.reflections;
+    printf("%s,%d,%d,%s,%d,%.3f,%.0f,%.0f,%.0f,%.0f,%.2f\n",
+           name, n_prims, n_threads, opts->wavefront ? "wavefront" : "tiles", frames,
+           per_frame * 1e3,
+           total.primary / elapsed, total.shadow / elapsed, total.reflections / elapsed,
+           rays / elapsed, base > 0 ? base / per_frame : 1.);
+    fflush(stdout);
+    return per_frame;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = detect_threads();
+    int max_prims = 1000000;
+
+    struct render_opts_t opts;
+    opts.bounces = MAX_BOUNCES;
+    opts.packet = packet_width();
+    opts.wavefront = false;
+    opts.weight = 255;
+    opts.light_samples = 0;
+    opts.light_cutoff = .25;
+    opts.seed = 0;
+    opts.aa = 0;
+    opts.aa_contrast = 16;
+    opts.reproject = NULL;
+    opts.progress = false;
+
+    int c;
+    while((c = getopt(argc, argv, "fj:l:n:p:w")) != -1)
+    {
+        switch(c)
+        {
+        case 'f':
+            opts.weight = INFINITY;
+            break;
+        case 'j':
+            max_threads = atoi(optarg);
+            break;
+        case 'l':
+            opts.light_samples = atoi(optarg);
+            break;
+        case 'n':
+            max_prims = atoi(optarg);
+            break;
+        case 'p':
+            opts.packet = atoi(optarg);
+            if((opts.packet != 0 && opts.packet != 4 && opts.packet != 8 && opts.packet != 16) ||
+               opts.packet > packet_width())
+            {
+                fprintf(stderr, "packet width must be 0 (off) or one of 4, 8, 16 up to %d\n", packet_width());
+                return 1;
+            }
+            break;
+        case 'w':
+            opts.wavefront = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f] [-j max threads] [-l light samples] [-n max primitives] [-p packet width] [-w]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(max_threads < 1)
+        max_threads = 1;
+
+    struct object_t *objs = malloc((MAX(max_prims, LIGHTS_SPHERES) + 5) * sizeof(*objs));
+    struct light_t *lights = malloc(MAX_LIGHTS * sizeof(*lights));
+    struct instance_t *insts = malloc(max_prims * sizeof(*insts));
+    struct mesh_t mesh;
+    random_mesh(&mesh);
+    struct framebuffer_t fb;
+    if(!fb_create(&fb, WIDTH, HEIGHT, FB_RGBA32))
+        abort();
+
+    struct camera_t cam;
+    cam.origin = vec3_make(0, 1, -5);
+    cam.direction = (vector) { RECT, { .rect = { 1, 0, 0 } } };
+    cam.fov_x = M_PI;
+    cam.fov_y = M_PI * HEIGHT / WIDTH;
+
+    struct camera_view_t view = { 0 };
+    camera_view_update(&view, &cam, WIDTH, HEIGHT);
+
+    struct render_pool_t *check_pool = create_pool(max_threads);
+    bool cutoff_ok = check_cutoff(check_pool, &fb, &view, &opts);
+    destroy_pool(check_pool);
+    if(!cutoff_ok)
+        return 1;
+
+    printf("scene,primitives,threads,mode,frames,ms_per_frame,"
+           "primary_per_s,shadow_per_s,reflected_per_s,total_per_s,speedup\n");
+
+    for(int kind = CLASSIC; kind <= INSTANCES; ++kind)
+    {
+        int first = kind == LIGHTS ? 1 : 10, last = kind == LIGHTS ? MAX_LIGHTS : max_prims;
+        for(int n = first; n <= last; n *= 10)
+        {
+            struct scene_t scene;
+            memset(&scene, 0, sizeof(scene));
+            scene.bg = (struct rgb_t) { 0x87, 0xce, 0xeb };
+            scene.ambient = .2;
+            scene.objects = objs;
+            scene.lights = lights;
+            scene.n_lights = 1;
+            if(kind == CLASSIC)
+                scene.n_objects = classic_scene(objs, lights);
+            else if(kind == LIGHTS)
+            {
+                scene.n_objects = random_scene(objs, lights, SPHERES, LIGHTS_SPHERES);
+                random_lights(lights, n);
+                scene.n_lights = n;
+            }
+            else if(kind == INSTANCES)
+            {
+                /* just the ground plane from an empty random scene */
+                scene.n_objects = random_scene(objs, lights, SPHERES, 0);
+                random_instances(insts, n);
+                scene.meshes = &mesh;
+                scene.n_meshes = 1;
+                scene.instances = insts;
+                scene.n_instances = n;
+            }
+            else
+                scene.n_objects = random_scene(objs, lights, kind, n);
+            preprocess_scene(&scene);
+
+            /* the scaling curve: 1, 2, 4 ... threads, ending on max_threads */
+            double base = 0;
+            for(int t = 1; ; t = t * 2 < max_threads ? t * 2 : max_threads)
+            {
+                struct render_pool_t *pool = create_pool(t);
+                double per_frame = run(pool, t, &fb, &scene, &view, &opts, kind_names[kind],
+                                       kind == CLASSIC ? 5 : n, base);
+                if(t == 1)
+                    base = per_frame;
+                destroy_pool(pool);
+                if(t == max_threads)
+                    break;
+            }
+
+            free_scene(&scene);
+
+            /* the classic scene has no size to sweep */
+            if(kind == CLASSIC)
+                break;
+        }
+    }
+
+    camera_view_free(&view);
+    fb_free(&fb);
+    free(objs);
+    free(lights);
+    free(insts);
+    free_mesh(&mesh);
+    return 0;
+}
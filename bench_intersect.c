@@ -0,0 +1,337 @@
+/* micro-benchmark: ray/object intersection with the old tagged
+ * vector kernel versus the per-type structure-of-arrays ones in scene.c,
+ * and the barycentric triangle test tri_intersects() used to do versus
+ * the Moller-Trumbore one it does now, both checked against a double
+ * precision reference
+ *
+ * cc -O2 -o bench_intersect bench_intersect.c scene.c vector.c -lm
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "scene.h"
+#include "vector.h"
+
+#define N_OBJECTS 1024
+#define N_RAYS 4096
+
+/* the object layout and intersection routine as they were before vec3 */
+struct legacy_object_t {
+    int type;
+    union {
+        struct { vector center; scalar radius; } sphere;
+        struct { vector points[3], normal, u, v; scalar uu, uv, vv, dn; } tri;
+    };
+};
+
+static bool legacy_intersects(const struct legacy_object_t *obj, vector o, vector d, scalar *t)
+{
+    switch(obj->type)
+    {
+    case SPHERE:
+    {
+        scalar a = SQR(d.rect.x) + SQR(d.rect.y) + SQR(d.rect.z),
+            b = 2 * ((o.rect.x - obj->sphere.center.rect.x) * d.rect.x +
+                     (o.rect.y - obj->sphere.center.rect.y) * d.rect.y +
+                     (o.rect.z - obj->sphere.center.rect.z) * d.rect.z),
+            c = SQR(o.rect.x - obj->sphere.center.rect.x) +
+                SQR(o.rect.y - obj->sphere.center.rect.y) +
+                SQR(o.rect.z - obj->sphere.center.rect.z) - SQR(obj->sphere.radius);
+        scalar disc = b*b - 4*a*c;
+        if(disc < 0)
+            return false;
+        scalar t1 = (-b - sqrt(disc)) / (2*a), t2 = (-b + sqrt(disc)) / (2*a);
+        if(t1 < 0 && t2 < 0)
+            return false;
+        if(t1 * t2 < 0)
+        {
+            *t = MAX(t1, t2);
+            return true;
+        }
+        vector prod = d;
+        prod = vect_mul(prod, t2);
+        prod = vect_add(prod, o);
+        *t = MIN(t1, t2);
+        return true;
+    }
+    case TRI:
+    {
+        if(vect_abs(obj->tri.normal) == 0)
+            return false;
+        scalar denom = vect_dot(obj->tri.normal, d);
+        if(!denom)
+            return false;
+        scalar t1 = vect_dot(obj->tri.normal, vect_sub(obj->tri.points[0], o)) / denom;
+        if(t1 <= 0)
+            return false;
+        vector pt = vect_add(vect_mul(d, t1), o);
+        vect_to_rect(&pt);
+        vector w = vect_sub(pt, obj->tri.points[0]);
+        scalar wu = vect_dot(w, obj->tri.u), wv = vect_dot(w, obj->tri.v);
+        scalar s1 = (obj->tri.uv * wv - obj->tri.vv * wu) / obj->tri.dn;
+        if(s1 < 0. || s1 > 1.)
+            return false;
+        scalar s2 = (obj->tri.uv * wu - obj->tri.uu * wv) / obj->tri.dn;
+        if(s2 < 0. || (s1 + s2) > 1.)
+            return false;
+        *t = t1;
+        return true;
+    }
+    }
+    return false;
+}
+
+/* tri_intersects() as it was before the precomputed records: the plane
+ * first, then the barycentrics of the hit point */
+static bool barycentric_intersects(const struct tri_array_t *tri, int i, vec3 o, vec3 d, scalar *t)
+{
+    vec3 p0 = tri_vertex(tri, tri->i0[i]),
+        u = vec3_sub(tri_vertex(tri, tri->i1[i]), p0),
+        v = vec3_sub(tri_vertex(tri, tri->i2[i]), p0);
+    vec3 normal = vec3_cross(u, v);
+    scalar denom = vec3_dot(normal, d);
+    if(!denom)
+        return false;
+    scalar t1 = vec3_dot(normal, vec3_sub(p0, o)) / denom;
+    if(t1 <= 0)
+        return false;
+
+    vec3 pt = vec3_add(vec3_mul(d, t1), o);
+    vec3 w = vec3_sub(pt, p0);
+    scalar uu = vec3_dot(u, u), uv = vec3_dot(u, v), vv = vec3_dot(v, v),
+        dn = SQR(uv) - uu * vv;
+    scalar wu = vec3_dot(w, u), wv = vec3_dot(w, v);
+    scalar s1 = (uv * wv - vv * wu) / dn;
+    if(s1 < 0. || s1 > 1.)
+        return false;
+    scalar s2 = (uv * wu - uu * wv) / dn;
+    if(s2 < 0. || (s1 + s2) > 1.)
+        return false;
+    *t = t1;
+    return true;
+}
+
+/* Moller-Trumbore in double, from the vertices; *edge is how far
+ * inside the triangle the hit is, in barycentric units, so a miss by
+ * either single precision test that close to an edge is just rounding */
+static bool reference_intersects(const struct tri_array_t *tri, int i, vec3 o, vec3 d,
+                                 double *t, double *edge)
+{
+    double p0[3] = { tri->x[tri->i0[i]], tri->y[tri->i0[i]], tri->z[tri->i0[i]] },
+        p1[3] = { tri->x[tri->i1[i]], tri->y[tri->i1[i]], tri->z[tri->i1[i]] },
+        p2[3] = { tri->x[tri->i2[i]], tri->y[tri->i2[i]], tri->z[tri->i2[i]] };
+    double e1[3], e2[3], s[3], dd[3] = { d.x, d.y, d.z }, p[3], q[3];
+    for(int a = 0; a < 3; ++a)
+    {
+        e1[a] = p1[a] - p0[a];
+        e2[a] = p2[a] - p0[a];
+    }
+    s[0] = o.x - p0[0];
+    s[1] = o.y - p0[1];
+    s[2] = o.z - p0[2];
+    for(int a = 0; a < 3; ++a)
+    {
+        int b = (a + 1) % 3, c = (a + 2) % 3;
+        p[a] = dd[b] * e2[c] - dd[c] * e2[b];
+        q[a] = s[b] * e1[c] - s[c] * e1[b];
+    }
+    double det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    *t = 0;
+    *edge = 1;
+    if(!det)
+        return false;
+    double u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) / det,
+        v = (dd[0] * q[0] + dd[1] * q[1] + dd[2] * q[2]) / det;
+    *t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) / det;
+    *edge = MIN(MIN(u, v), 1 - u - v);
+    return *edge >= 0 && *t > 0;
+}
+
+static scalar rand_range(scalar lo, scalar hi)
+{
+    return lo + (hi - lo) * (rand() / (scalar)RAND_MAX);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void)
+{
+    static struct object_t objs[N_OBJECTS];
+    static struct legacy_object_t legacy[N_OBJECTS];
+    static vec3 origins[N_RAYS], dirs[N_RAYS];
+
+    srand(1);
+    for(int i = 0; i < N_OBJECTS; ++i)
+    {
+        vec3 c = vec3_make(rand_range(-10, 10), rand_range(-10, 10), rand_range(5, 25));
+        if(i & 1)
+        {
+            objs[i].type = SPHERE;
+            objs[i].sphere.center = c;
+            objs[i].sphere.radius = rand_range(.1, 1);
+        }
+        else
+        {
+            objs[i].type = TRI;
+            for(int j = 0; j < 3; ++j)
+                objs[i].tri.points[j] = vec3_add(c, vec3_make(rand_range(-1, 1), rand_range(-1, 1), rand_range(-1, 1)));
+        }
+    }
+
+    struct scene_t scene = { 0 };
+    scene.objects = objs;
+    scene.n_objects = N_OBJECTS;
+    preprocess_scene(&scene);
+
+    /* mirror the per-type arrays into the legacy layout, in the same
+     * order so the hit distances are summed identically */
+    const struct sphere_array_t *s = &scene.spheres;
+    const struct tri_array_t *tri = &scene.tris;
+    int n_legacy = 0;
+    for(int i = 0; i < s->n; ++i, ++n_legacy)
+    {
+        legacy[n_legacy].type = SPHERE;
+        legacy[n_legacy].sphere.center = vec3_to_vect(vec3_make(s->x[i], s->y[i], s->z[i]));
+        legacy[n_legacy].sphere.radius = objs[s->id[i]].sphere.radius;
+    }
+    for(int i = 0; i < tri->n; ++i, ++n_legacy)
+    {
+        const vec3 *pts = objs[tri->id[i]].tri.points;
+        vec3 u = vec3_sub(pts[1], pts[0]), v = vec3_sub(pts[2], pts[0]);
+        legacy[n_legacy].type = TRI;
+        for(int j = 0; j < 3; ++j)
+            legacy[n_legacy].tri.points[j] = vec3_to_vect(pts[j]);
+        legacy[n_legacy].tri.normal = vec3_to_vect(vec3_cross(u, v));
+        legacy[n_legacy].tri.u = vec3_to_vect(u);
+        legacy[n_legacy].tri.v = vec3_to_vect(v);
+        legacy[n_legacy].tri.uu = vec3_dot(u, u);
+        legacy[n_legacy].tri.uv = vec3_dot(u, v);
+        legacy[n_legacy].tri.vv = vec3_dot(v, v);
+        legacy[n_legacy].tri.dn = SQR(legacy[n_legacy].tri.uv) - legacy[n_legacy].tri.uu * legacy[n_legacy].tri.vv;
+    }
+
+    for(int i = 0; i < N_RAYS; ++i)
+    {
+        origins[i] = vec3_make(rand_range(-1, 1), rand_range(-1, 1), 0);
+        dirs[i] = vec3_normalize(vec3_make(rand_range(-.5, .5), rand_range(-.5, .5), 1));
+    }
+
+    /* both kernels must agree before their timings mean anything */
+    long hits_legacy = 0, hits_soa = 0, mismatches = 0;
+    double sum_legacy = 0, sum_soa = 0;
+
+    double start = now();
+    for(int r = 0; r < N_RAYS; ++r)
+    {
+        vector o = vec3_to_vect(origins[r]), d = vec3_to_vect(dirs[r]);
+        for(int i = 0; i < n_legacy; ++i)
+        {
+            scalar t;
+            if(legacy_intersects(legacy + i, o, d, &t))
+            {
+                ++hits_legacy;
+                sum_legacy += t;
+            }
+        }
+    }
+    double legacy_time = now() - start;
+
+    start = now();
+    for(int r = 0; r < N_RAYS; ++r)
+    {
+        scalar t;
+        for(int i = 0; i < s->n; ++i)
+        {
+            if(sphere_intersects(s, i, origins[r], dirs[r], &t))
+            {
+                ++hits_soa;
+                sum_soa += t;
+            }
+        }
+        for(int i = 0; i < tri->n; ++i)
+        {
+            if(tri_intersects(tri, i, origins[r], dirs[r], &t))
+            {
+                ++hits_soa;
+                sum_soa += t;
+            }
+        }
+    }
+    double soa_time = now() - start;
+
+    /* the legacy sphere test takes a double-precision square root, so
+     * the distances only agree to within rounding */
+    if(hits_legacy != hits_soa || fabs(sum_legacy - sum_soa) > 1e-6 * fabs(sum_legacy))
+        mismatches = 1;
+
+    /* the two triangle tests, against the reference. a disagreement is
+     * only a bug if the reference hit isn't within rounding of an edge */
+    long tri_hits = 0, wrong_bary = 0, wrong_mt = 0, near_edge = 0;
+    double err_bary = 0, err_mt = 0;
+    for(int r = 0; r < N_RAYS; ++r)
+    {
+        for(int i = 0; i < tri->n; ++i)
+        {
+            double ref_t, edge;
+            scalar t_bary = 0, t_mt = 0;
+            bool ref = reference_intersects(tri, i, origins[r], dirs[r], &ref_t, &edge);
+            bool bary = barycentric_intersects(tri, i, origins[r], dirs[r], &t_bary),
+                mt = tri_intersects(tri, i, origins[r], dirs[r], &t_mt);
+            bool close = fabs(edge) < 1e-5;
+            tri_hits += ref;
+            near_edge += close;
+            if(bary != ref && !close)
+                ++wrong_bary;
+            if(mt != ref && !close)
+                ++wrong_mt;
+            if(ref && bary)
+                err_bary = MAX(err_bary, fabs(t_bary - ref_t) / ref_t);
+            if(ref && mt)
+                err_mt = MAX(err_mt, fabs(t_mt - ref_t) / ref_t);
+        }
+    }
+
+    scalar t;
+    long bary_count = 0, mt_count = 0;
+    start = now();
+    for(int r = 0; r < N_RAYS; ++r)
+        for(int i = 0; i < tri->n; ++i)
+            bary_count += barycentric_intersects(tri, i, origins[r], dirs[r], &t);
+    double bary_time = now() - start;
+    start = now();
+    for(int r = 0; r < N_RAYS; ++r)
+        for(int i = 0; i < tri->n; ++i)
+            mt_count += tri_intersects(tri, i, origins[r], dirs[r], &t);
+    double mt_time = now() - start;
+
+    double tests = (double)N_RAYS * n_legacy;
+    printf("tests:  %.0f (%ld hits)\n", tests, hits_soa);
+    printf("legacy: %.3f s, %.1f Mtests/s\n", legacy_time, tests / legacy_time * 1e-6);
+    printf("soa:    %.3f s, %.1f Mtests/s\n", soa_time, tests / soa_time * 1e-6);
+    printf("speedup: %.2fx\n", legacy_time / soa_time);
+    if(mismatches)
+        printf("WARNING: kernels disagree (%ld vs %ld hits)\n", hits_legacy, hits_soa);
+
+    double tri_tests = (double)N_RAYS * tri->n;
+    printf("\ntriangle tests: %.0f (%ld hits, %ld within 1e-5 of an edge)\n", tri_tests, tri_hits, near_edge);
+    printf("barycentric:     %.3f s, %.1f Mtests/s, %ld wrong, max t error %.1e\n",
+           bary_time, tri_tests / bary_time * 1e-6, wrong_bary, err_bary);
+    printf("moller-trumbore: %.3f s, %.1f Mtests/s, %ld wrong, max t error %.1e\n",
+           mt_time, tri_tests / mt_time * 1e-6, wrong_mt, err_mt);
+    printf("speedup: %.2fx\n", bary_time / mt_time);
+    if(wrong_bary || wrong_mt)
+    {
+        printf("WARNING: triangle tests disagree with the reference\n");
+        mismatches = 1;
+    }
+    free_scene(&scene);
+    return mismatches;
+}
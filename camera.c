@@ -0,0 +1,101 @@
+#include <stdlib.h>
+
+#include "camera.h"
+
+static void camera_view_resize(struct camera_view_t *view, int w, int h)
+{
+    if(view->w != w)
+    {
+        view->sin_az = realloc(view->sin_az, sizeof(double) * w);
+        view->cos_az = realloc(view->cos_az, sizeof(double) * w);
+        view->w = w;
+    }
+    if(view->h != h)
+    {
+        view->cos_el = realloc(view->cos_el, sizeof(double) * h);
+        view->sin_el = realloc(view->sin_el, sizeof(double) * h);
+        view->h = h;
+    }
+}
+
+void camera_view_update(struct camera_view_t *view, const struct camera_t *cam, int w, int h)
+{
+    camera_view_resize(view, w, h);
+    view->origin = cam->origin;
+
+    vector direction = cam->direction;
+    vect_to_sph(&direction);
+
+    /* angle per pixel; rays sweep [-fov / 2, fov / 2) about the direction */
+    scalar scale_x = tan(.5 * cam->fov_x / w), scale_y = tan(.5 * cam->fov_y / h);
+    view->az = direction.sph.azimuth - (w / 2) * scale_x;
+    view->daz = scale_x;
+    view->el = direction.sph.elevation + (h / 2) * scale_y;
+    view->del = -scale_y;
+    view->r = direction.sph.r;
+
+    /* same arithmetic as vect_to_rect() on the rotated direction, split
+     * into its row and column factors */
+    for(int x = 0; x < w; ++x)
+    {
+        scalar azimuth = direction.sph.azimuth + (x - w / 2) * scale_x;
+        view->sin_az[x] = sin(azimuth);
+        view->cos_az[x] = cos(azimuth);
+    }
+    for(int y = 0; y < h; ++y)
+    {
+        scalar elevation = direction.sph.elevation - (y - h / 2) * scale_y;
+        view->cos_el[y] = direction.sph.r * cos(elevation);
+        view->sin_el[y] = direction.sph.r * sin(elevation);
+    }
+}
+
+void camera_view_subsample(struct camera_view_t *view, const struct camera_view_t *src, int step)
+{
+    camera_view_resize(view, (src->w + step - 1) / step, (src->h + step - 1) / step);
+    view->origin = src->origin;
+    view->az = src->az;
+    view->daz = src->daz * step;
+    view->el = src->el;
+    view->del = src->del * step;
+    view->r = src->r;
+    for(int x = 0; x < view->w; ++x)
+    {
+        view->sin_az[x] = src->sin_az[x * step];
+        view->cos_az[x] = src->cos_az[x * step];
+    }
+    for(int y = 0; y < view->h; ++y)
+    {
+        view->cos_el[y] = src->cos_el[y * step];
+        view->sin_el[y] = src->sin_el[y * step];
+    }
+}
+
+void camera_view_crop(struct camera_view_t *view, const struct camera_view_t *src, int x0, int y0, int w, int h)
+{
+    camera_view_resize(view, w, h);
+    view->origin = src->origin;
+    view->az = src->az + x0 * src->daz;
+    view->daz = src->daz;
+    view->el = src->el + y0 * src->del;
+    view->del = src->del;
+    view->r = src->r;
+    for(int x = 0; x < w; ++x)
+    {
+        view->sin_az[x] = src->sin_az[x0 + x];
+        view->cos_az[x] = src->cos_az[x0 + x];
+    }
+    for(int y = 0; y < h; ++y)
+    {
+        view->cos_el[y] = src->cos_el[y0 + y];
+        view->sin_el[y] = src->sin_el[y0 + y];
+    }
+}
+
+void camera_view_free(struct camera_view_t *view)
+{
+    free(view->sin_az);
+    free(view->cos_az);
+    free(view->cos_el);
+    free(view->sin_el);
+}
@@ -0,0 +1,91 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <stdbool.h>
+
+#include "vec3.h"
+#include "vector.h"
+
+struct camera_t {
+    vec3 origin; /* position */
+    vector direction;
+    scalar fov_x, fov_y; /* radians */
+};
+
+/* a camera direction looking along the world-space d; the spherical
+ * convention directions go through (vect_to_sph() and back) has x and
+ * z swapped, so d is swapped on the way in to come out as given */
+static inline vector camera_direction(vec3 d)
+{
+    return (vector) { RECT, { .rect = { d.z, d.y, d.x } } };
+}
+
+/* the camera's projection for one frame at a given resolution; a
+ * pixel's column only moves its azimuth and its row only its
+ * elevation, so the trig is done once per column and once per row and
+ * each primary ray is a few multiplies */
+struct camera_view_t {
+    vec3 origin;
+    int w, h;
+    double *sin_az, *cos_az; /* per column */
+    double *cos_el, *sin_el; /* per row, scaled by the direction's length */
+    /* for rays between pixel centres: column x is at azimuth az + x * daz,
+     * row y at elevation el + y * del */
+    double az, daz, el, del, r;
+};
+
+/* (re)builds view for cam at w x h; view must be zeroed before first use */
+void camera_view_update(struct camera_view_t *view, const struct camera_t *cam, int w, int h);
+void camera_view_free(struct camera_view_t *view);
+
+/* builds view from every step-th column and row of src, so pixel (x, y)
+ * of it is pixel (x * step, y * step) of src; zeroed before first use
+ * like any other view */
+void camera_view_subsample(struct camera_view_t *view, const struct camera_view_t *src, int step);
+
+/* builds view from the w x h pixels of src from (x0, y0), so its
+ * rays are exactly those of that part of src; zeroed before first use
+ * like any other view */
+void camera_view_crop(struct camera_view_t *view, const struct camera_view_t *src, int x0, int y0, int w, int h);
+
+/* direction of the primary ray through pixel (x, y) */
+static inline vec3 camera_ray(const struct camera_view_t *view, int x, int y)
+{
+    return vec3_make(view->cos_el[y] * view->sin_az[x],
+                     view->sin_el[y],
+                     view->cos_el[y] * view->cos_az[x]);
+}
+
+/* direction of the ray through (x, y) in pixels, which needn't be a
+ * pixel centre; does its own trig, so only for the odd extra ray */
+static inline vec3 camera_subpixel(const struct camera_view_t *view, double x, double y)
+{
+    double az = view->az + x * view->daz, el = view->el + y * view->del;
+    return vec3_make(view->r * cos(el) * sin(az), view->r * sin(el), view->r * cos(el) * cos(az));
+}
+
+/* the pixel nearest the ray from view->origin through pt, in the
+ * terms camera_subpixel() uses; false if that is off the image */
+static inline bool camera_project(const struct camera_view_t *view, vec3 pt, int *x, int *y)
+{
+    vec3 v = vec3_sub(pt, view->origin);
+    double az = atan2(v.x, v.z), el = atan2(v.y, sqrt(v.x * v.x + v.z * v.z));
+    /* azimuth from the middle of the view, in [-pi, pi) */
+    double mid = view->az + .5 * view->w * view->daz;
+    az = remainder(az - mid, 2 * M_PI) + mid;
+    double fx = (az - view->az) / view->daz, fy = (el - view->el) / view->del;
+    *x = lround(fx);
+    *y = lround(fy);
+    return *x >= 0 && *x < view->w && *y >= 0 && *y < view->h;
+}
+
+/* directions of the n primary rays from (x, y) along a row */
+static inline void camera_row(const struct camera_view_t *view, int x, int y, int n, vec3 *out)
+{
+    double cos_el = view->cos_el[y];
+    scalar sin_el = view->sin_el[y];
+    for(int i = 0; i < n; ++i)
+        out[i] = vec3_make(cos_el * view->sin_az[x + i], sin_el, cos_el * view->cos_az[x + i]);
+}
+
+#endif
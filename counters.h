@@ -0,0 +1,25 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+/* build with -DCOUNTERS to count the work done in the hot paths; each
+ * thread counts into its own copy, and the render pool hands a worker's
+ * counts to its render_stats_t at the end of a frame. without it every
+ * COUNT() compiles to nothing */
+
+struct counters_t {
+    long nearest, occlusion; /* scene_intersections(), scene_occluded() */
+    long occluded;           /* occlusion queries that were blocked */
+    long box_tests;          /* BVH node bounds */
+    long prim_tests;         /* sphere, plane and triangle tests */
+    long packets;            /* packet queries of either kind */
+    long packet_box_tests, packet_prim_tests; /* each tests every lane */
+};
+
+#ifdef COUNTERS
+extern __thread struct counters_t counters;
+#define COUNT(field) (counters.field++)
+#else
+#define COUNT(field) ((void)0)
+#endif
+
+#endif
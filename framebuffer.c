@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "framebuffer.h"
+
+bool fb_create(struct framebuffer_t *fb, int w, int h, enum fb_format_t format)
+{
+    size_t pitch = ((size_t)w * fb_pixel_size(format) + 63) & ~(size_t)63;
+    void *pixels;
+    if(posix_memalign(&pixels, 64, pitch * h))
+        return false;
+    fb_wrap(fb, pixels, w, h, pitch, format);
+    fb->owned = true;
+    return true;
+}
+
+void fb_wrap(struct framebuffer_t *fb, void *pixels, int w, int h, size_t pitch, enum fb_format_t format)
+{
+    fb->pixels = pixels;
+    fb->w = w;
+    fb->h = h;
+    fb->y0 = 0;
+    fb->pitch = pitch;
+    fb->format = format;
+    fb->owned = false;
+}
+
+void fb_free(struct framebuffer_t *fb)
+{
+    if(fb->owned)
+        free(fb->pixels);
+    fb->pixels = NULL;
+}
+
+static inline unsigned char float_step(float f)
+{
+    return f <= 0 ? 0 : f >= 255 ? 255 : (unsigned char)(f + .5f);
+}
+
+void fb_read_row(const struct framebuffer_t *fb, int x, int y, int n, struct rgb_t *out)
+{
+    const unsigned char *px = (const unsigned char *)fb_row(fb, y) + (size_t)x * fb_pixel_size(fb->format);
+    switch(fb->format)
+    {
+    case FB_RGB24:
+        memcpy(out, px, 3 * n);
+        break;
+    case FB_RGBA32:
+        for(int i = 0; i < n; ++i, px += 4)
+            out[i] = (struct rgb_t) { px[0], px[1], px[2] };
+        break;
+    case FB_BGRA32:
+        for(int i = 0; i < n; ++i, px += 4)
+            out[i] = (struct rgb_t) { px[2], px[1], px[0] };
+        break;
+    case FB_FLOAT:
+    {
+        const float *f = (const float *)px;
+        for(int i = 0; i < n; ++i, f += 4)
+            out[i] = (struct rgb_t) { float_step(f[0]), float_step(f[1]), float_step(f[2]) };
+        break;
+    }
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "scene.h"
+
+enum fb_format_t {
+    FB_RGB24,  /* r, g, b packed: what a PPM holds */
+    FB_RGBA32, /* r, g, b, 0xff */
+    FB_BGRA32, /* b, g, r, 0xff: a 0xff0000 red mask on little endian */
+    FB_FLOAT,  /* r, g, b, a as floats on the same 0-255 scale, for sums */
+};
+
+/* rows [y0, y0 + h) of a w-wide image. created ones start every row
+ * on a 64-byte boundary, so with 4-byte pixels a tile row is whole
+ * cache lines and workers on neighbouring tiles never share one;
+ * wrapped ones, such as an SDL surface, have whatever pitch they come
+ * with. FB_RGB24 is the slow path: a tile row is 48 bytes, so tiles
+ * side by side share the cache lines at their edges and workers on
+ * them contend. PPM output and the server render into it anyway, so
+ * that finished rows can be written out as they are */
+struct framebuffer_t {
+    unsigned char *pixels; /* row y0 */
+    int w, h, y0;
+    size_t pitch;          /* bytes from one row to the next */
+    enum fb_format_t format;
+    bool owned;
+};
+
+static inline int fb_pixel_size(enum fb_format_t format)
+{
+    switch(format)
+    {
+    case FB_RGB24:
+        return 3;
+    case FB_RGBA32:
+    case FB_BGRA32:
+        return 4;
+    default:
+        return 4 * sizeof(float);
+    }
+}
+
+/* false if out of memory */
+bool fb_create(struct framebuffer_t *fb, int w, int h, enum fb_format_t format);
+void fb_wrap(struct framebuffer_t *fb, void *pixels, int w, int h, size_t pitch, enum fb_format_t format);
+void fb_free(struct framebuffer_t *fb);
+
+/* start of image row y, which must be held */
+static inline void *fb_row(const struct framebuffer_t *fb, int y)
+{
+    return fb->pixels + (size_t)(y - fb->y0) * fb->pitch;
+}
+
+/* stores n pixels from (x, y) along a row; one call per row or run
+ * of a row, so the format is looked at once per run */
+static inline void fb_write_row(const struct framebuffer_t *fb, int x, int y,
+                                const struct rgb_t *colors, int n)
+{
+    unsigned char *px = (unsigned char *)fb_row(fb, y) + (size_t)x * fb_pixel_size(fb->format);
+    switch(fb->format)
+    {
+    case FB_RGB24:
+        memcpy(px, colors, 3 * n);
+        break;
+    case FB_RGBA32:
+        for(int i = 0; i < n; ++i, px += 4)
+        {
+            px[0] = colors[i].r;
+            px[1] = colors[i].g;
+            px[2] = colors[i].b;
+            px[3] = 0xff;
+        }
+        break;
+    case FB_BGRA32:
+        for(int i = 0; i < n; ++i, px += 4)
+        {
+            px[0] = colors[i].b;
+            px[1] = colors[i].g;
+            px[2] = colors[i].r;
+            px[3] = 0xff;
+        }
+        break;
+    case FB_FLOAT:
+    {
+        float *f = (float *)px;
+        for(int i = 0; i < n; ++i, f += 4)
+        {
+            f[0] = colors[i].r;
+            f[1] = colors[i].g;
+            f[2] = colors[i].b;
+            f[3] = 255;
+        }
+        break;
+    }
+    }
+}
+
+/* the reverse, rounding floats to the nearest step */
+void fb_read_row(const struct framebuffer_t *fb, int x, int y, int n, struct rgb_t *out);
+
+#endif
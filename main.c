@@ -1,9 +1,19 @@
 #include <stdbool.h>
 #include <stdlib.h>
-#include <assert.h>
 #include <stdio.h>
-#include <pthread.h>
-
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "anim.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "obj.h"
+#include "packet.h"
+#include "render.h"
+#include "scene.h"
+#include "scenefile.h"
+#include "server.h"
 #include "vector.h"
 
 #include <SDL/SDL.h>
@@ -12,595 +22,789 @@
 #define WIDTH 320
 #define HEIGHT 240
 
-#define MAX(a, b) ((a>b)?(a):(b))
-#define MIN(a, b) ((a<b)?(a):(b))
-#define SQR(a) ((a)*(a))
-#define SIGN(x) ((x)<0?-1:1)
+/* the most passes -P averages */
+#define MAX_SAMPLES 256
+
+/* rows rendered and written at a time, so a PPM of any size needs two
+ * bands of memory; a multiple of the tile size */
+#define BAND_ROWS 64
 
-#define MAX_BOUNCES 50
 #define MIN_BOUNCES 2
 #define MOVE_FACTOR .15
 #define TARGET_MS 50
 
-#define N_LIGHTS 1
+/* the viewer renders at as little as this much of the window's width
+ * and height, then scales up */
+#define MIN_SCALE .25
+/* weight of the newest frame in the viewer's running cost estimates */
+#define SMOOTHING .2
 
 #define PPMOUT
 
 #define MOUSELOOK
 
-struct rgb_t { unsigned char r, g, b; };
-
-struct object_t {
-    enum { SPHERE, PLANE, TRI } type;
-    union {
-        struct { vector center; scalar radius; } sphere;
-        struct { vector point, normal; } plane;
-        struct { vector points[3], normal, u, v; scalar uu, uv, vv, dn; } tri;
-    };
-    struct rgb_t color;
-    int specularity; /* 0-255 */
-};
-
-struct light_t {
-    vector position;
-    scalar intensity;
-};
+scalar rand_norm(void)
+{
+    return rand() / (scalar)RAND_MAX;
+}
 
-struct scene_t {
-    struct rgb_t bg;
-    struct object_t *objects;
-    size_t n_objects;
-    struct light_t *lights;
-    size_t n_lights;
-    scalar ambient;
-};
+/* a cache is only trusted if nothing has touched the scene file since
+ * it was written; edits to the OBJ files a scene uses aren't noticed */
+static bool cache_is_fresh(const char *cache_path, const char *scene_path)
+{
+    struct stat cache_st, scene_st;
+    if(stat(cache_path, &cache_st) < 0 || stat(scene_path, &scene_st) < 0)
+        return false;
+    return cache_st.st_mtim.tv_sec > scene_st.st_mtim.tv_sec ||
+        (cache_st.st_mtim.tv_sec == scene_st.st_mtim.tv_sec &&
+         cache_st.st_mtim.tv_nsec > scene_st.st_mtim.tv_nsec);
+}
 
-struct camera_t {
-    vector origin; /* position */
-    vector direction;
-    scalar fov_x, fov_y; /* radians */
-};
+/* a -A frame name: exactly one %d, which may have a width and 0 */
+static bool frame_pattern_ok(const char *pattern)
+{
+    const char *pc = strchr(pattern, '%');
+    if(!pc)
+        return false;
+    const char *end = pc + 1 + strspn(pc + 1, "0123456789");
+    return *end == 'd' && !strchr(end, '%');
+}
 
-void preprocess_object(struct object_t *obj)
+#ifdef PPMOUT
+/* rows [y0, y1) of an FB_RGB24 framebuffer as PPM pixel data */
+static bool write_rows(FILE *f, const struct framebuffer_t *fb, int y0, int y1)
 {
-    switch(obj->type)
-    {
-    case TRI:
-        obj->tri.u = vect_sub(obj->tri.points[1], obj->tri.points[0]);
-        obj->tri.v = vect_sub(obj->tri.points[2], obj->tri.points[0]);
-        obj->tri.normal = vect_cross(obj->tri.u, obj->tri.v);
-        obj->tri.uu = vect_dot(obj->tri.u, obj->tri.u);
-        obj->tri.uv = vect_dot(obj->tri.u, obj->tri.v);
-        obj->tri.vv = vect_dot(obj->tri.v, obj->tri.v);
-        obj->tri.dn = SQR(obj->tri.uv) - obj->tri.uu * obj->tri.vv;
-        break;
-    }
+    for(int y = y0; y < y1; ++y)
+        if(fwrite(fb_row(fb, y), 3, fb->w, f) != (size_t)fb->w)
+            return false;
+    return true;
 }
 
-/* { o, d } form a ray */
-/* point of intersection is *t * d units away */
-inline bool object_intersects(const struct object_t *obj, vector o, vector d, scalar *t)
+/* streams the frame to a PPM a band at a time: each band is written
+ * while the next one renders. overlap, if not NULL, is called once
+ * while the first band renders, for the caller to get on with
+ * whatever it can while the workers are busy */
+static bool render_ppm(const char *path, struct render_pool_t *pool,
+                       const struct scene_t *scene, const struct camera_view_t *view,
+                       const struct render_opts_t *opts, void (*overlap)(void *), void *data)
 {
-    assert(o.type == RECT);
-    assert(d.type == RECT);
-    switch(obj->type)
+    FILE *f = fopen(path, "wb");
+    if(!f)
     {
-    case SPHERE:
+        perror(path);
+        return false;
+    }
+
+    /* progress goes by bands here rather than by tiles */
+    struct render_opts_t band_opts = *opts;
+    band_opts.progress = false;
+
+    int w = view->w, h = view->h;
+    struct framebuffer_t band[2];
+    bool ok = fb_create(&band[0], w, BAND_ROWS, FB_RGB24);
+    if(ok && !fb_create(&band[1], w, BAND_ROWS, FB_RGB24))
     {
-        scalar a = SQR(d.rect.x) + SQR(d.rect.y) + SQR(d.rect.z),
-            b = 2 * ((o.rect.x - obj->sphere.center.rect.x) * d.rect.x +
-                     (o.rect.y - obj->sphere.center.rect.y) * d.rect.y +
-                     (o.rect.z - obj->sphere.center.rect.z) * d.rect.z),
-            c = SQR(o.rect.x - obj->sphere.center.rect.x) +
-                SQR(o.rect.y - obj->sphere.center.rect.y) +
-                SQR(o.rect.z - obj->sphere.center.rect.z) - SQR(obj->sphere.radius);
-        scalar disc = b*b - 4*a*c;
-        if(disc < 0)
-        {
-            //printf("no intersection (%f)\n", disc);
-            return false;
-        }
-        scalar t1 = (-b - sqrt(disc)) / (2*a), t2 = (-b + sqrt(disc)) / (2*a);
-        /* both are negative */
-        if(t1 < 0 && t2 < 0)
-        {
-            //printf("no intersection\n");
-            return false;
-        }
-        /* one is negative */
-        if(t1 * t2 < 0)
-        {
-            //printf("camera is inside sphere (%f, %f)!\n", t1, t2);
-            *t = MAX(t1, t2);
-            return true;
-        }
-        vector prod = d;
-        prod = vect_mul(prod, t2);
-        prod = vect_add(prod, o);
-        //printf("ray from (%f, %f, %f) intersects sphere at point %f, %f, %f (%f)\n", o->rect.x, o->rect.y, o->rect.z, prod.rect.x, prod.rect.y, prod.rect.z, vect_abs(&prod));
-        *t = MIN(t1, t2);
-        return true;
+        fb_free(&band[0]);
+        ok = false;
     }
-    case PLANE:
+    bool made = ok;
+    ok = ok && fprintf(f, "P6\n%d %d\n%d\n", w, h, 255) > 0;
+
+    if(ok)
     {
-        scalar denom = vect_dot(obj->plane.normal, d);
-        if(!denom)
-            return false;
-        scalar t1 = vect_dot(obj->plane.normal, vect_sub(obj->plane.point, o)) / denom;
-        if(t1 <= 0)
-            return false;
-        *t = t1;
-        return true;
+        render_rows(pool, &band[0], scene, view, 0, MIN(BAND_ROWS, h), &band_opts);
+        if(overlap)
+            overlap(data);
     }
-    case TRI:
+    for(int y = 0, i = 0; ok && y < h; y += BAND_ROWS, i ^= 1)
     {
-        if(vect_abs(obj->tri.normal) == 0)
+        int rows = MIN(BAND_ROWS, h - y);
+        render_wait(pool);
+        if(y + rows < h)
         {
-            //printf("degenerate triangle\n");
-            return false;
-        }
-        scalar denom = vect_dot(obj->tri.normal, d);
-        /* doesn't intersect plane of triangle */
-        if(!denom)
-        {
-            //printf("parallel\n");
-            return false;
-        }
-        scalar t1 = vect_dot(obj->tri.normal, vect_sub(obj->tri.points[0], o)) / denom;
-        /* behind camera */
-        if(t1 <= 0)
-        {
-            //printf("behind camera\n");
-            return false;
+            band[i ^ 1].y0 = y + rows;
+            render_rows(pool, &band[i ^ 1], scene, view, y + rows, MIN(y + rows + BAND_ROWS, h), &band_opts);
         }
 
-        vector pt = vect_add(vect_mul(d, t1), o);
-        vect_to_rect(&pt);
-        scalar wu, wv;
-        vector w = vect_sub(pt, obj->tri.points[0]);
-        wu = vect_dot(w, obj->tri.u);
-        wv = vect_dot(w, obj->tri.v);
-        scalar s1 = (obj->tri.uv * wv - obj->tri.vv * wu) / obj->tri.dn;
-        if(s1 < 0. || s1 > 1.)
-        {
-            //printf("not inside\n");
-            return false;
-        }
-        scalar s2 = (obj->tri.uv * wu - obj->tri.uu * wv) / obj->tri.dn;
-        if(s2 < 0. || (s1 + s2) > 1.)
-        {
-            //printf("not inside\n");
-            return false;
-        }
-        *t = t1;
-        return true;
+        if(!write_rows(f, &band[i], y, y + rows))
+            ok = false;
+        if(opts->progress)
+            printf("%d/%d rows\n", y + rows, h);
     }
+    /* a write error can leave a band in flight */
+    render_wait(pool);
+
+    if(fclose(f) != 0)
+        ok = false;
+    if(!ok)
+        fprintf(stderr, "%s: write failed\n", path);
+    if(made)
+    {
+        fb_free(&band[0]);
+        fb_free(&band[1]);
     }
+    return ok;
 }
 
-vector normal_at_point(vector pt, const struct object_t *obj)
+/* everything frame n of an animation needs but the scene itself,
+ * worked out while frame n - 1 renders: until that is done the scene
+ * can't change, so the instances' moves wait in moves */
+struct next_frame_t {
+    const struct anim_t *anim;
+    const struct scene_t *scene;
+    int frame, w, h;
+    struct camera_t cam;
+    struct camera_view_t view;
+    struct anim_move_t *moves;
+    int n_moves;
+};
+
+static void prepare_frame(void *data)
 {
-    vector normal;
-    switch(obj->type)
+    struct next_frame_t *next = data;
+    anim_camera(next->anim, next->frame, &next->cam);
+    camera_view_update(&next->view, &next->cam, next->w, next->h);
+
+    /* only instances that actually go somewhere new are touched */
+    int n = anim_instances(next->anim, next->frame, next->moves);
+    next->n_moves = 0;
+    for(int i = 0; i < n; ++i)
     {
-    case SPHERE:
-        normal = vect_sub(pt, obj->sphere.center);
-        break;
-    case PLANE:
-        normal = obj->plane.normal;
-        break;
-    case TRI:
-        normal = vect_negate(obj->tri.normal);
-        break;
-    default:
-        assert(false);
+        const struct anim_move_t *move = next->moves + i;
+        if(memcmp(move->xform, next->scene->instance_refs[move->instance].to_world, sizeof(move->xform)))
+            next->moves[next->n_moves++] = *move;
     }
-    return normal;
 }
 
-/* return the direction of the reflected ray */
-vector reflect_ray(vector pt, vector d, vector normal, const struct object_t *obj)
+/* a PPM per frame, from one compiled scene that is moved and refit
+ * between frames rather than built again */
+static bool render_anim(const char *pattern, const struct anim_t *anim, struct render_pool_t *pool,
+                        struct scene_t *scene, const struct camera_t *cam, int w, int h,
+                        const struct render_opts_t *opts)
 {
-    scalar c = -2 * vect_dot(d, normal);
-    vector reflected = normal;
-    reflected = vect_mul(reflected, c);
-    reflected = vect_add(reflected, d);
-    return reflected;
+    struct next_frame_t next = { .anim = anim, .scene = scene, .w = w, .h = h, .cam = *cam };
+    next.moves = malloc(sizeof(struct anim_move_t) * MAX(anim->n_instances, 1));
+    struct camera_view_t view = { 0 };
+    struct render_opts_t frame_opts = *opts;
+    frame_opts.progress = false;
+
+    prepare_frame(&next);
+    bool ok = true;
+    for(int f = 0; ok && f < anim->n_frames; ++f)
+    {
+        for(int i = 0; i < next.n_moves; ++i)
+            scene_move_instance(scene, next.moves[i].instance, next.moves[i].xform);
+        if(next.n_moves)
+            refit_instances(scene);
+        struct camera_view_t tmp = view;
+        view = next.view;
+        next.view = tmp;
+
+        char path[4096];
+        snprintf(path, sizeof(path), pattern, f);
+        next.frame = f + 1;
+        ok = render_ppm(path, pool, scene, &view, &frame_opts,
+                        f + 1 < anim->n_frames ? prepare_frame : NULL, &next);
+        if(ok && opts->progress)
+            printf("%s: frame %d/%d\n", path, f + 1, anim->n_frames);
+    }
+
+    camera_view_free(&view);
+    camera_view_free(&next.view);
+    free(next.moves);
+    return ok;
 }
 
-struct rgb_t blend(struct rgb_t a, struct rgb_t b, unsigned char alpha)
+static bool print_pass(const struct render_pass_t *pass, void *data)
 {
-    struct rgb_t ret;
-    unsigned char r1, g1, b1;
-    ret.r = (((int)a.r * alpha) + ((int)b.r * (255 - alpha))) / 255;
-    ret.g = (((int)a.g * alpha) + ((int)b.g * (255 - alpha))) / 255;
-    ret.b = (((int)a.b * alpha) + ((int)b.b * (255 - alpha))) / 255;
-    return ret;
+    (void)data;
+    if(pass->step > 1)
+        printf("pass %d: %dx%d blocks\n", pass->pass, pass->step, pass->step);
+    else
+        printf("pass %d: %d samples, %.3f change\n", pass->pass, pass->samples, pass->change);
+    return true;
 }
 
-static const struct object_t *scene_intersections(const struct scene_t *scene,
-                                                  vector orig, vector d, scalar *dist, const struct object_t *avoid)
+static bool write_ppm(const char *path, const struct framebuffer_t *fb)
 {
-    *dist = -1;
-    const struct object_t *obj = NULL;
-    /* check intersections */
-    for(int i = 0; i < scene->n_objects; ++i)
+    FILE *f = fopen(path, "wb");
+    if(!f)
     {
-        /* avoid intersections with the same object */
-        if(avoid == scene->objects + i)
-            continue;
-        scalar t;
-        if(object_intersects(scene->objects + i, orig, d, &t))
-        {
-            if(*dist < 0 || t < *dist)
-            {
-                *dist = t;
-                obj = scene->objects + i;
-            }
-        }
+        perror(path);
+        return false;
     }
-    return obj;
+    bool ok = fprintf(f, "P6\n%d %d\n%d\n", fb->w, fb->h, 255) > 0 &&
+        write_rows(f, fb, 0, fb->h);
+    if(fclose(f) != 0)
+        ok = false;
+    if(!ok)
+        fprintf(stderr, "%s: write failed\n", path);
+    return ok;
 }
+#else
+/* holds the viewer's frame time: rather than react to the last frame
+ * alone, it keeps running averages of what a ray costs and how many
+ * rays a pixel takes, and from them picks the most pixels that fit in
+ * TARGET_MS. resolution takes up most of the slack; bounces only drop
+ * once it is as low as it goes, and only come back with room to spare
+ * at full size, one at a time so reflections don't pop */
+struct frame_ctl_t {
+    double ms_per_ray, rays_per_pixel; /* 0 until the first frame */
+    scalar scale;                      /* of the window's width and height */
+    int bounces;
+};
 
-#define ABS(x) ((x)<0?-(x):(x))
-
-struct rgb_t trace_ray(const struct scene_t *scene, vector orig, vector d, int max_iters, const struct object_t *avoid)
+static void frame_ctl_update(struct frame_ctl_t *ctl, double ms, const struct render_stats_t *stats)
 {
-    vector copy = d;
-    vect_to_sph(&copy);
-
-    struct rgb_t primary = blend((struct rgb_t) {0, 0x96, 0xff}, (struct rgb_t) { 0xfe, 0xfe, 0xfe },
-                                 ABS(copy.sph.elevation * 2 / M_PI * 255));
-    scalar hit_dist; /* distance from camera in terms of d */
-    const struct object_t *hit_obj = scene_intersections(scene, orig, d, &hit_dist, avoid);
-
-    struct rgb_t reflected = {0, 0, 0};
-    int specular = 255;
-
-    /* by default */
-    scalar shade_total = 1.0;
-
-    if(hit_obj)
+    long rays = stats->primary + stats->shadow + stats->reflections;
+    if(!rays || ms <= 0)
+        return;
+    double ms_per_ray = ms / rays, rays_per_pixel = (double)rays / stats->primary;
+    if(ctl->ms_per_ray)
     {
-        //printf("pow!\n");
-        primary = hit_obj->color;
-
-        /* shade */
+        ms_per_ray = SMOOTHING * ms_per_ray + (1 - SMOOTHING) * ctl->ms_per_ray;
+        rays_per_pixel = SMOOTHING * rays_per_pixel + (1 - SMOOTHING) * ctl->rays_per_pixel;
+    }
+    ctl->ms_per_ray = ms_per_ray;
+    ctl->rays_per_pixel = rays_per_pixel;
+}
 
-        vector pt = d;
-        pt = vect_mul(pt, hit_dist);
-        pt = vect_add(pt, orig);
+/* the scale and bounces for the next frame of a w x h window */
+static void frame_ctl_plan(struct frame_ctl_t *ctl, int w, int h)
+{
+    if(!ctl->ms_per_ray)
+        return;
+    double ms_per_pixel = ctl->ms_per_ray * ctl->rays_per_pixel;
+    scalar scale = sqrt(TARGET_MS / ms_per_pixel / ((double)w * h));
+
+    /* no more than a quarter either way per frame */
+    scale = MAX(MIN(scale, ctl->scale * 1.25), ctl->scale * .8);
+    if(scale >= 1)
+    {
+        if(ms_per_pixel * w * h < .75 * TARGET_MS && ctl->bounces < MAX_BOUNCES)
+            ctl->bounces++;
+        scale = 1;
+    }
+    else if(scale <= MIN_SCALE)
+    {
+        if(ctl->bounces > MIN_BOUNCES)
+            ctl->bounces--;
+        scale = MIN_SCALE;
+    }
+    ctl->scale = scale;
+}
 
-        vector normal = normal_at_point(pt, hit_obj);
+/* nearest-neighbour stretch of a frame over the whole screen, which
+ * has the frame's 32-bit format */
+static void blit_scaled(SDL_Surface *screen, const struct framebuffer_t *fb)
+{
+    int cols[screen->w];
+    for(int x = 0; x < screen->w; ++x)
+        cols[x] = x * fb->w / screen->w;
+    for(int y = 0; y < screen->h; ++y)
+    {
+        const Uint32 *src = fb_row(fb, y * fb->h / screen->h);
+        Uint32 *dst = (Uint32 *)((unsigned char *)screen->pixels + (size_t)y * screen->pitch);
+        for(int x = 0; x < screen->w; ++x)
+            dst[x] = src[cols[x]];
+    }
+}
 
-        shade_total = 0;
+struct show_pass_t {
+    SDL_Surface *screen;
+    const struct framebuffer_t *fb;
+    bool direct;    /* fb is the screen, locked */
+    unsigned start; /* SDL_GetTicks() at the start of the frame */
+    /* and at the start and end of the full size pass, which is all the
+     * render stats count */
+    unsigned full_start, full_end;
+};
 
-        for(int i = 0; i < scene->n_lights; ++i)
-        {
-            /* get vector to light */
-            vector light_dir = vect_sub(scene->lights[i].position, pt);
+/* shows each pass as it comes, and gives up on a frame that has run
+ * over time as soon as there is input to act on */
+static bool show_pass(const struct render_pass_t *pass, void *data)
+{
+    struct show_pass_t *show = data;
+    if(pass->step == 1)
+        show->full_end = SDL_GetTicks();
+    if(show->direct)
+        SDL_UnlockSurface(show->screen);
+    else
+    {
+        SDL_LockSurface(show->screen);
+        blit_scaled(show->screen, show->fb);
+        SDL_UnlockSurface(show->screen);
+    }
+    SDL_UpdateRect(show->screen, 0, 0, 0, 0);
+    if(show->direct)
+        SDL_LockSurface(show->screen);
+    if(pass->step > 1)
+        show->full_start = SDL_GetTicks();
+    if(SDL_GetTicks() - show->start < TARGET_MS)
+        return true;
+    SDL_PumpEvents();
+    return SDL_PeepEvents(NULL, 0, SDL_PEEKEVENT, SDL_ALLEVENTS) == 0;
+}
+#endif
 
-            scalar light_dist = vect_abs(light_dir);
+int main(int argc, char *argv[])
+{
+    /* 0 means one per CPU */
+    int n_threads = 0;
+
+    struct render_opts_t opts;
+    opts.bounces = MAX_BOUNCES;
+    /* widest the CPU can do, unless told otherwise */
+    opts.packet = packet_width();
+    opts.wavefront = false;
+    /* camera rays can move a pixel by at most 255 steps */
+    opts.weight = 255;
+    /* every light, bar groups worth under a quarter of a step */
+    opts.light_samples = 0;
+    opts.light_cutoff = .25;
+    opts.seed = 0;
+    opts.aa = 0;
+    opts.aa_contrast = 16;
+    opts.reproject = NULL;
+#ifdef PPMOUT
+    opts.progress = true;
+#else
+    opts.progress = false;
+#endif
 
-            light_dir = vect_normalize(light_dir);
+    /* OBJ files to add to the scene */
+    const char *mesh_paths[argc];
+    int n_meshes = 0;
 
-            /* see if light is occluded */
-            scalar nearest;
-            const struct object_t *obj = scene_intersections(scene, pt, light_dir, &nearest, hit_obj);
+    const char *scene_path = NULL, *cache_path = NULL, *anim_path = NULL;
+    /* render for clients on this socket, or on stdin and stdout for "-" */
+    const char *serve_path = NULL;
 
-            if(obj && nearest < light_dist)
-                continue;
+    /* lights in the built-in scene */
+    int n_lights = 1;
 
-            scalar shade = vect_dot(normal, light_dir);
-            if(shade > 0)
-                shade_total += shade * scene->lights[i].intensity * 1 / SQR(light_dist);
-        }
+    int width = WIDTH, height = HEIGHT;
+    const char *out_path = NULL;
 
-        if(shade_total > 1)
-            shade_total = 1;
+    /* progressive until a pass changes the image by less than this */
+    scalar threshold = -1;
 
-        specular = 255 - hit_obj->specularity;
-        /* reflections */
-        if(specular != 255 && max_iters > 0)
+    int c;
+    while((c = getopt(argc, argv, "a:A:c:fj:l:L:m:o:p:P:r:s:S:w")) != -1)
+    {
+        switch(c)
         {
-            vector ref = reflect_ray(pt, d, normal, hit_obj);
-            reflected = trace_ray(scene, pt, ref, max_iters - 1, hit_obj);
+        case 'a':
+            /* antialias edges with a x a rays */
+            opts.aa = atoi(optarg);
+            break;
+        case 'A':
+            /* a run of frames from keyframes */
+            anim_path = optarg;
+            break;
+        case 'c':
+            cache_path = optarg;
+            break;
+        case 'f':
+            /* follow every bounce, however little it adds */
+            opts.weight = INFINITY;
+            break;
+        case 'j':
+            n_threads = atoi(optarg);
+            break;
+        case 'l':
+            opts.light_samples = atoi(optarg);
+            break;
+        case 'L':
+            n_lights = atoi(optarg);
+            if(n_lights < 1)
+            {
+                fprintf(stderr, "need at least one light\n");
+                return 1;
+            }
+            break;
+        case 'm':
+            mesh_paths[n_meshes++] = optarg;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'p':
+            opts.packet = atoi(optarg);
+            if((opts.packet != 0 && opts.packet != 4 && opts.packet != 8 && opts.packet != 16) ||
+               opts.packet > packet_width())
+            {
+                fprintf(stderr, "packet width must be 0 (off) or one of 4, 8, 16 up to %d\n", packet_width());
+                return 1;
+            }
+            break;
+        case 'P':
+            threshold = atof(optarg);
+            break;
+        case 'r':
+            if(sscanf(optarg, "%dx%d", &width, &height) != 2 || width < 1 || height < 1)
+            {
+                fprintf(stderr, "resolution must be WIDTHxHEIGHT\n");
+                return 1;
+            }
+            break;
+        case 's':
+            scene_path = optarg;
+            break;
+        case 'S':
+            serve_path = optarg;
+            break;
+        case 'w':
+            opts.wavefront = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-a samples per axis] [-A anim] [-c cache] [-f] [-j threads] [-l light samples] [-L lights] [-m mesh.obj]... [-o out.ppm] [-p packet width] [-P threshold] [-r WIDTHxHEIGHT] [-s scene] [-S socket|-] [-w]\n", argv[0]);
+            return 1;
         }
-
-        scalar diffuse = 1 - scene->ambient;
-        primary.r *= (scene->ambient + diffuse * shade_total);
-        primary.g *= (scene->ambient + diffuse * shade_total);
-        primary.b *= (scene->ambient + diffuse * shade_total);
     }
 
-    struct rgb_t mixed = blend(primary, reflected, specular);
-
-
-    return mixed;
-}
-
-vector ray_to_pixel(vector origin, vector direction, int x, int y, int w, int h, const struct camera_t *cam)
-{
-    scalar scale_x = tan(.5 * cam->fov_x / w), scale_y = tan(.5 * cam->fov_y / h);
-
-    /* rot in range of [-fov / 2, fov / 2) */
-    scalar rot_x = (x - w / 2) * scale_x, rot_y = (y - h / 2) * scale_y;
-
-    /* rotate the offset vector */
-
-    vector d = direction;
-    assert(d.type == SPH);
+    /* the built-in scene depends on -L and -r, which a cache can't
+     * tell apart, and is quick to build anyway */
+    if(cache_path && !scene_path)
+    {
+        fprintf(stderr, "-c caches a scene file, so it needs -s\n");
+        return 1;
+    }
+    if(anim_path && threshold >= 0)
+    {
+        fprintf(stderr, "-A and -P don't go together\n");
+        return 1;
+    }
+    if(serve_path && (anim_path || threshold >= 0))
+    {
+        fprintf(stderr, "-S takes its frames from requests, so no -A or -P\n");
+        return 1;
+    }
+    if(!out_path)
+        out_path = anim_path ? "frame%04d.ppm" : "test.ppm";
+    if(anim_path && !frame_pattern_ok(out_path))
+    {
+        fprintf(stderr, "with -A, the output name needs one %%d for the frame number\n");
+        return 1;
+    }
+    struct anim_t anim = { 0 };
+    if(anim_path && !load_anim(anim_path, &anim))
+        return 1;
+
+    /* serving on stdout, which anything else printed would corrupt,
+     * so that goes to stderr instead */
+    int reply_fd = 1;
+    if(serve_path && !strcmp(serve_path, "-"))
+    {
+        reply_fd = dup(1);
+        dup2(2, 1);
+    }
 
-    d.sph.elevation -= rot_y;
-    d.sph.azimuth += rot_x;
+    struct scene_t scene;
+    struct camera_t cam;
+    cam.origin = vec3_make(0, 1, -5);
+    cam.direction = (vector) { RECT, { .rect = { 1, 0, 0 } } };
+    cam.fov_x = M_PI;
+    cam.fov_y = M_PI * height / width;
 
-    vect_to_rect(&d);
-    return d;
-}
+    /* the lights the scene renders from, unless they are in a cache;
+     * freed at the end */
+    struct light_t *loaded_lights = NULL;
 
-void render_lines(unsigned char *fb, int w, int h,
-                  const struct scene_t *scene,
-                  const struct camera_t *cam,
-                  int start, int end, int bounces, int worker)
-{
-    scalar scale_x = tan(.5 * cam->fov_x / w), scale_y = tan(.5 * cam->fov_y / h);
+    struct object_t sph[8];
 
-    vector direction = cam->direction;
-    vect_to_sph(&direction);
+    int load_threads = n_threads > 0 ? n_threads : detect_threads();
 
-    for(int y = 0; y < h; ++y)
+    /* extra meshes change the scene, so they rule out a cache */
+    if(cache_path && !n_meshes && cache_is_fresh(cache_path, scene_path) &&
+       map_scene_cache(cache_path, &scene, &cam))
     {
-        for(int x = start; x < end; ++x)
+        printf("%s: %d objects, %d meshes, %d instances from the cache\n", cache_path,
+               (int)scene.n_objects, (int)scene.n_meshes, (int)scene.n_instances);
+    }
+    else
+    {
+        if(scene_path)
+        {
+            memset(&scene, 0, sizeof(scene));
+            if(!load_scene(scene_path, &scene, &cam, load_threads))
+                return 1;
+            loaded_lights = scene.lights;
+        }
+        else
         {
-            /* trace a ray from the camera into the scene */
-            /* figure out how to rotate the offset vector to suit the
-             * current pixel */
+            scene.bg.r = 0x87;
+            scene.bg.g = 0xce;
+            scene.bg.b = 0xeb;
+            scene.ambient = .2;
 
-            /* rot in range of [-fov / 2, fov / 2) */
-            scalar rot_x = (x - w / 2) * scale_x, rot_y = (y - h / 2) * scale_y;
+#if 1
+            sph[0].type = SPHERE;
+            sph[0].sphere.center = vec3_make(1, 1, 0);
+            sph[0].sphere.radius = 1;
+            sph[0].color = (struct rgb_t){0, 0, 0xff};
+            sph[0].specularity = 0xf0;
+
+            sph[1].type = SPHERE;
+            sph[1].sphere.center = vec3_make(-1, 1, 0);
+            sph[1].sphere.radius = 1;
+            sph[1].color = (struct rgb_t){0xff, 0, 0};
+            sph[1].specularity = 40;
+
+            sph[2].type = SPHERE;
+            sph[2].sphere.center = vec3_make(-3, 1, 0);
+            sph[2].sphere.radius = 1;
+            sph[2].color = (struct rgb_t){0xff, 0xff, 0xff};
+            sph[2].specularity = 0xf0;
+
+            sph[3].type = PLANE;
+            sph[3].plane.point = vec3_make(0, 0, 0);
+            sph[3].plane.normal = vec3_make(0, 1, 0);
+            sph[3].color = (struct rgb_t) {0, 0xff, 0};
+            sph[3].specularity = 0;
+#endif
 
-            vector d = ray_to_pixel(cam->origin, direction, x, y, w, h, cam);
+            sph[4].type = TRI;
+            sph[4].tri.points[0] = vec3_make(5, 0, 0);
+            sph[4].tri.points[1] = vec3_make(5, 5, 0);
+            sph[4].tri.points[2] = vec3_make(0, 5, 0);
+            sph[4].color = (struct rgb_t) {0xff, 0, 0};
+            sph[4].specularity = 0x30;
 
-            /* cam->origin and d now form the camera ray */
+            struct light_t *lights = malloc(sizeof(struct light_t) * n_lights);
+            if(!lights)
+            {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+            loaded_lights = lights;
 
-            struct rgb_t color = trace_ray(scene, cam->origin, d, bounces, NULL);
+            /* distribute evenly in a sphere of r = 1 */
+            for(int i = 0; i < n_lights; ++i)
+            {
+                vector offset = { SPH, { .sph.r = rand_norm(),
+                                         .sph.elevation = 2 * M_PI * (rand_norm() - .5),
+                                         .sph.azimuth = 4 * M_PI * (rand_norm() - .5) } };
+                lights[i].position = vec3_add(vec3_make(5, 10, -5), vect_to_vec3(offset));
+                lights[i].intensity = 200. / n_lights;
+            }
 
-#ifdef PPMOUT
-            fb[y * w * 3 + 3 * x] = color.r;
-            fb[y * w * 3 + 3 * x + 1] = color.g;
-            fb[y * w * 3 + 3 * x + 2] = color.b;
-#else
-            fb[y * w * 3 + 3 * x] = color.b;
-            fb[y * w * 3 + 3 * x + 1] = color.g;
-            fb[y * w * 3 + 3 * x + 2] = color.r;
-#endif
+            scene.objects = sph;
+            scene.n_objects = 5;
+            scene.lights = lights;
+            scene.n_lights = n_lights;
+            scene.meshes = NULL;
+            scene.n_meshes = 0;
+            scene.instances = NULL;
+            scene.n_instances = 0;
+        }
 
+        /* -m meshes go after any the scene file has */
+        struct mesh_t *meshes = realloc(scene.meshes, sizeof(struct mesh_t) * (scene.n_meshes + n_meshes + 1));
+        for(int i = 0; i < n_meshes; ++i)
+        {
+            struct mesh_t *mesh = meshes + scene.n_meshes + i;
+            if(!load_obj(mesh_paths[i], mesh, load_threads))
+                return 1;
+            printf("%s: %d vertices, %d triangles\n", mesh_paths[i], mesh->n_verts, mesh->n_tris);
         }
-#ifdef PPMOUT
-        printf("Worker %d: %d%% (%d/%d)\n", worker, 100 * (y+1) / h, y+1, h);
-#endif
-    }
-}
+        scene.meshes = meshes;
+        scene.n_meshes += n_meshes;
 
-struct renderinfo_t {
-    unsigned char *fb;
-    int w, h;
-    const struct scene_t *scene;
-    const struct camera_t *cam;
-    int start, end;
-    int bounces;
-    int worker;
-};
+        preprocess_scene(&scene);
+        if(cache_path && save_scene_cache(cache_path, &scene, &cam))
+            printf("%s: saved\n", cache_path);
 
-void *thread(void *ptr)
-{
-    struct renderinfo_t *info = ptr;
-    render_lines(info->fb, info->w, info->h, info->scene, info->cam, info->start, info->end, info->bounces, info->worker);
-    return NULL;
-}
+        /* only the compiled scene is rendered from */
+        if(!scene_path)
+            scene.objects = NULL;
+        free_scene_description(&scene);
+    }
 
-void render_scene(unsigned char *fb, int w, int h,
-                  const struct scene_t *scene,
-                  const struct camera_t *cam, int n_threads, int n_bounces)
-{
-    struct renderinfo_t *info = malloc(sizeof(struct renderinfo_t) * n_threads);
-    pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
-    for(int i = 0; i < n_threads; ++i)
+    if(anim_path && anim.max_instance >= (int)scene.n_instances)
     {
-        info[i].fb = fb;
-        info[i].w = w;
-        info[i].h = h;
-        info[i].scene = scene;
-        info[i].cam = cam;
-        info[i].start = w * i / n_threads;
-        info[i].end = w * (i + 1) / n_threads;
-        info[i].bounces = n_bounces;
-        info[i].worker = i;
-        pthread_create(threads + i, NULL, thread, info + i);
+        fprintf(stderr, "%s: the scene has no instance %d\n", anim_path, anim.max_instance);
+        return 1;
     }
 
-    for(int i = 0; i < n_threads; ++i)
-        pthread_join(threads[i], NULL);
+    struct camera_view_t view = { 0 };
 
-    free(info);
-}
+    struct render_pool_t *pool = create_pool(n_threads);
 
-scalar rand_norm(void)
-{
-    return rand() / (scalar)RAND_MAX;
-}
-
-void preprocess_scene(const struct scene_t *scene)
-{
-    for(int i = 0; i < scene->n_objects; ++i)
+#ifdef PPMOUT
+    camera_view_update(&view, &cam, width, height);
+    bool ok;
+    if(serve_path)
     {
-        preprocess_object(scene->objects + i);
+        /* the command line's options, bar bounces, apply to every request */
+        opts.progress = false;
+        ok = serve(strcmp(serve_path, "-") ? serve_path : NULL, 0, reply_fd, pool, &scene, &opts);
+        camera_view_free(&view);
+        destroy_pool(pool);
+        free_scene(&scene);
+        free(loaded_lights);
+        return ok ? 0 : 1;
     }
-}
-
-int main()
-{
-    struct scene_t scene;
-    scene.bg.r = 0x87;
-    scene.bg.g = 0xce;
-    scene.bg.b = 0xeb;
-    scene.ambient = .2;
-
-    struct object_t sph[8];
-
-#if 1
-    sph[0].type = SPHERE;
-    sph[0].sphere.center = (vector) { RECT, {1, 1, 0 } };
-    sph[0].sphere.radius = 1;
-    sph[0].color = (struct rgb_t){0, 0, 0xff};
-    sph[0].specularity = 0xf0;
-
-    sph[1].type = SPHERE;
-    sph[1].sphere.center = (vector) { RECT, {-1, 1, 0 } };
-    sph[1].sphere.radius = 1;
-    sph[1].color = (struct rgb_t){0xff, 0, 0};
-    sph[1].specularity = 40;
-
-    sph[2].type = SPHERE;
-    sph[2].sphere.center = (vector) { RECT, {-3, 1, 0 } };
-    sph[2].sphere.radius = 1;
-    sph[2].color = (struct rgb_t){0xff, 0xff, 0xff};
-    sph[2].specularity = 0xf0;
-
-    sph[3].type = PLANE;
-    sph[3].plane.point = (vector) { RECT, {0, 0, 0 } };
-    sph[3].plane.normal = (vector) { RECT, {0, 1, 0 } };
-    sph[3].color = (struct rgb_t) {0, 0xff, 0};
-    sph[3].specularity = 0;
-#endif
-
-    sph[4].type = TRI;
-    sph[4].tri.points[0] = (vector) { RECT, {5, 0, 0 } };
-    sph[4].tri.points[1] = (vector) { RECT, {5, 5, 0 } };
-    sph[4].tri.points[2] = (vector) { RECT, {0, 5, 0 } };
-    sph[4].color = (struct rgb_t) {0xff, 0, 0};
-    sph[4].specularity = 0x30;
-
-    /* distribute evenly in a sphere of r = 1 */
-    struct light_t lights[N_LIGHTS];
-    for(int i = 0; i < N_LIGHTS; ++i)
+    if(threshold >= 0)
     {
-        lights[i].position = vect_add((vector) { RECT, {5, 10, -5} },
-                                      (vector) { SPH, { .sph.r = rand_norm(),
-                                                  .sph.elevation = 2 * M_PI * (rand_norm() - .5),
-                                                  .sph.azimuth = 4 * M_PI * (rand_norm() - .5) } } );
-        lights[i].intensity = 200 / N_LIGHTS;
+        /* progressive needs the whole frame at once */
+        struct framebuffer_t fb;
+        if(!fb_create(&fb, width, height, FB_RGB24))
+        {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        opts.progress = false;
+        render_progressive(pool, &fb, &scene, &view, &opts, MAX_SAMPLES, threshold, true, print_pass, NULL);
+        ok = write_ppm(out_path, &fb);
+        fb_free(&fb);
     }
-
-    scene.objects = sph;
-    scene.n_objects = 5;
-    scene.lights = lights;
-    scene.n_lights = N_LIGHTS;
-
-    struct camera_t cam;
-    cam.origin = (vector){ RECT, {0, 1, -5} };
-    cam.direction = (vector){ RECT, {1, 0, 0} };
-    cam.fov_x = M_PI;
-    cam.fov_y = M_PI * HEIGHT / WIDTH;
-
-    unsigned char *fb = malloc(WIDTH * HEIGHT * 3);
-
-    preprocess_scene(&scene);
-
-#ifdef PPMOUT
-    render_scene(fb, WIDTH, HEIGHT, &scene, &cam, 2, MAX_BOUNCES);
-    FILE *f = fopen("test.ppm", "w");
-    fprintf(f, "P6\n%d %d\n%d\n", WIDTH, HEIGHT, 255);
-    fwrite(fb, WIDTH * HEIGHT, 3, f);
-    fclose(f);
-    free(fb);
-    return 0;
+    else if(anim_path)
+        ok = render_anim(out_path, &anim, pool, &scene, &cam, width, height, &opts);
+    else
+        ok = render_ppm(out_path, pool, &scene, &view, &opts, NULL, NULL);
+    if(ok)
+        print_render_stats(pool);
+    free_anim(&anim);
+    camera_view_free(&view);
+    destroy_pool(pool);
+    free_scene(&scene);
+    free(loaded_lights);
+    return ok ? 0 : 1;
 
 #else
-    /* auto-adjusting */
-    int bounces = MIN_BOUNCES;
+    (void)out_path;
+    (void)threshold;
+    (void)reply_fd;
+    /* the viewer is interactive, so it has no use for keyframes */
+    free_anim(&anim);
+
+    struct frame_ctl_t ctl = { 0, 0, 1, MIN_BOUNCES };
+    opts.reproject = reproject_create();
 
     SDL_Init(SDL_INIT_VIDEO);
-    SDL_Surface *screen = SDL_SetVideoMode(WIDTH, HEIGHT, 24, SDL_HWSURFACE);
+    SDL_Surface *screen = SDL_SetVideoMode(width, height, 32, SDL_SWSURFACE);
     SDL_EnableKeyRepeat(500, 50);
 
-    int ts = SDL_GetTicks();
+    /* at full size the workers draw straight into the screen; scaled
+     * frames go to fb first */
+    enum fb_format_t format;
+    if(screen->format->Rmask == 0xff0000)
+        format = FB_BGRA32;
+    else if(screen->format->Rmask == 0xff)
+        format = FB_RGBA32;
+    else
+    {
+        fprintf(stderr, "unsupported screen format\n");
+        SDL_Quit();
+        return 1;
+    }
+    struct framebuffer_t fb, frame;
+    if(!fb_create(&fb, width, height, format))
+        abort();
+    struct show_pass_t show = { screen, &frame, false, 0, 0, 0 };
+    /* previews are only worth their cost once frames run over time */
+    bool late = true;
 
     while(1)
     {
+        frame_ctl_plan(&ctl, width, height);
+        opts.bounces = ctl.bounces;
+        int w = MAX(1, (int)(width * ctl.scale)), h = MAX(1, (int)(height * ctl.scale));
+        show.direct = w == width && h == height;
+        if(show.direct)
+        {
+            SDL_LockSurface(screen);
+            fb_wrap(&frame, screen->pixels, width, height, screen->pitch, format);
+        }
+        else
+        {
+            frame = fb;
+            frame.w = w;
+            frame.h = h;
+        }
+
 #ifdef MOUSELOOK
         /* mouse look */
         int x, y;
         unsigned mouse = SDL_GetMouseState(&x, &y);
-        x -= WIDTH / 2;
-        y -= HEIGHT / 2;
+        x -= width / 2;
+        y -= height / 2;
         vect_to_sph(&cam.direction);
-        cam.direction.sph.azimuth += M_PI/10 * SIGN(x)*SQR((scalar)x / WIDTH);
-        cam.direction.sph.elevation += M_PI/10 * SIGN(y)*SQR((scalar)y / HEIGHT);
+        cam.direction.sph.azimuth += M_PI/10 * SIGN(x)*SQR((scalar)x / width);
+        cam.direction.sph.elevation += M_PI/10 * SIGN(y)*SQR((scalar)y / height);
+        camera_view_update(&view, &cam, w, h);
         if(mouse & SDL_BUTTON(1))
         {
-            vector d = ray_to_pixel(cam.origin, cam.direction, x + WIDTH/2, y + HEIGHT/2, WIDTH, HEIGHT, &cam);
+            vec3 d = camera_ray(&view, (x + width/2) * w / width, (y + height/2) * h / height);
             scalar dist;
-            struct object_t *obj = scene_intersections(&scene, cam.origin, d, &dist, NULL);
-            if(obj)
+            int hit = scene_intersections(&scene, cam.origin, d, &dist, -1);
+            if(hit >= 0)
             {
-                obj->color = (struct rgb_t) { 0xff, 0, 0xff };
+                scene_material(&scene, hit)->color = (struct rgb_t) { 0xff, 0, 0xff };
+                reproject_reset(opts.reproject);
                 printf("Clicked object at %d, %d\n", x, y);
             }
         }
+#else
+        camera_view_update(&view, &cam, w, h);
 #endif
 
-        render_scene(fb, WIDTH, HEIGHT, &scene, &cam, 2, bounces);
-        memcpy(screen->pixels, fb, WIDTH * HEIGHT * 3);
-        SDL_UpdateRect(screen, 0, 0, 0, 0);
-
-        int now = SDL_GetTicks();
-        int dt = now - ts;
-
-        if(dt < TARGET_MS && bounces < MAX_BOUNCES)
-        {
-            /* too fast! */
-            bounces *= 2;
-            if(bounces > MAX_BOUNCES)
-                bounces = MAX_BOUNCES;
-        }
-        else if(dt > TARGET_MS && bounces > MIN_BOUNCES)
-        {
-            bounces /= 2;
-            if(bounces < MIN_BOUNCES)
-                bounces = MIN_BOUNCES;
-        }
-
-        ts = now;
+        show.start = show.full_start = SDL_GetTicks();
+        int samples = render_progressive(pool, &frame, &scene, &view, &opts, 1, 0, late, show_pass, &show);
+        if(show.direct)
+            SDL_UnlockSurface(screen);
+        double ms = SDL_GetTicks() - show.start;
+        late = ms > TARGET_MS;
+
+        /* the stats are the full size pass's, so it alone is timed; a
+         * frame given up on was over time, but its rays aren't all
+         * counted, so it only nudges the cost up */
+        struct render_stats_t stats;
+        render_stats(pool, &stats);
+        if(samples)
+            frame_ctl_update(&ctl, show.full_end - show.full_start, &stats);
+        else if(ctl.ms_per_ray)
+            ctl.ms_per_ray *= 1.25;
 
         SDL_Event e;
-        //printf("camera at %f, %f, %f\n", cam.origin.rect.x, cam.origin.rect.y, cam.origin.rect.z);
+        //printf("camera at %f, %f, %f\n", cam.origin.x, cam.origin.y, cam.origin.z);
         while(SDL_PollEvent(&e))
         {
             switch(e.type)
             {
             case SDL_QUIT:
-                free(fb);
+                fb_free(&fb);
+                reproject_free(opts.reproject);
+                camera_view_free(&view);
+                destroy_pool(pool);
+                free_scene(&scene);
+                free(loaded_lights);
                 return 0;
             case SDL_KEYDOWN:
                 switch(e.key.keysym.sym)
                 {
                 case SDLK_ESCAPE:
-                    free(fb);
+                    fb_free(&fb);
+                    reproject_free(opts.reproject);
+                    camera_view_free(&view);
+                    destroy_pool(pool);
+                    free_scene(&scene);
+                    free(loaded_lights);
                     SDL_Quit();
                     return 0;
                 case SDLK_UP:
-                    cam.origin.rect.y += .1;
+                    cam.origin.y += .1;
                     break;
                 case SDLK_DOWN:
-                    cam.origin.rect.y -= .1;
+                    cam.origin.y -= .1;
                     break;
                 case SDLK_a:
                 {
                     vector tmp = cam.direction;
                     vect_to_sph(&tmp);
                     tmp.sph.azimuth -= M_PI/2;
-                    cam.origin = vect_add(cam.origin, vect_mul(tmp, MOVE_FACTOR));
+                    cam.origin = vec3_add(cam.origin, vect_to_vec3(vect_mul(tmp, MOVE_FACTOR)));
                     break;
                 }
                 case SDLK_d:
@@ -608,28 +812,28 @@ int main()
                     vector tmp = cam.direction;
                     vect_to_sph(&tmp);
                     tmp.sph.azimuth += M_PI/2;
-                    cam.origin = vect_add(cam.origin, vect_mul(tmp, MOVE_FACTOR));
+                    cam.origin = vec3_add(cam.origin, vect_to_vec3(vect_mul(tmp, MOVE_FACTOR)));
                     break;
                 }
                 case SDLK_w:
-                    cam.origin = vect_add(cam.origin, vect_mul(cam.direction, MOVE_FACTOR));
+                    cam.origin = vec3_add(cam.origin, vect_to_vec3(vect_mul(cam.direction, MOVE_FACTOR)));
                     break;
                 case SDLK_s:
-                    cam.origin = vect_sub(cam.origin, vect_mul(cam.direction, MOVE_FACTOR));
+                    cam.origin = vec3_sub(cam.origin, vect_to_vec3(vect_mul(cam.direction, MOVE_FACTOR)));
                     break;
                 case SDLK_MINUS:
                     cam.fov_x += M_PI/36;
-                    cam.fov_y = cam.fov_x * HEIGHT/WIDTH;
+                    cam.fov_y = cam.fov_x * height/width;
                     break;
                 case SDLK_EQUALS:
                     cam.fov_x -= M_PI/36;
-                    cam.fov_y = cam.fov_x * HEIGHT/WIDTH;
+                    cam.fov_y = cam.fov_x * height/width;
                     break;
                 case SDLK_SPACE:
-                    cam.origin.rect.y += .1;
+                    cam.origin.y += .1;
                     break;
                 case SDLK_LSHIFT:
-                    cam.origin.rect.y -= .1;
+                    cam.origin.y -= .1;
                     break;
                 case SDLK_LEFT:
                 {
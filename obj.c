@@ -0,0 +1,348 @@
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "obj.h"
+
+/* the file is cut into this many pieces per thread, at line breaks,
+ * so one slow piece (say, all faces) doesn't hold up the rest */
+#define CHUNKS_PER_THREAD 4
+
+/* one piece of the file. the first pass counts what is in it, which
+ * says where each piece's vertices and triangles go, and the second
+ * pass parses straight into place */
+struct obj_chunk_t {
+    const char *start, *end;
+    int n_lines, n_verts, n_tris;
+    int first_line, first_vert, first_tri;
+    struct mesh_t *mesh;
+    int bad_line; /* first line that wouldn't parse, or 0 */
+};
+
+struct obj_job_t {
+    struct obj_chunk_t *chunks;
+    int n_chunks;
+    int next;    /* claimed with an atomic increment */
+    bool parse;  /* false for the counting pass */
+};
+
+static inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *skip_space(const char *p, const char *end)
+{
+    while(p < end && is_space(*p))
+        ++p;
+    return p;
+}
+
+static const char *line_end(const char *p, const char *end)
+{
+    const char *nl = memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+/* true if the line (after leading space) starts with the keyword
+ * followed by a space */
+static bool keyword(const char *p, const char *end, const char *word, int len)
+{
+    return end - p > len && !memcmp(p, word, len) && is_space(p[len]);
+}
+
+static bool parse_int(const char **pp, const char *end, long *out)
+{
+    const char *p = *pp;
+    bool neg = false;
+    if(p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+    if(p >= end || *p < '0' || *p > '9')
+        return false;
+    long v = 0;
+    while(p < end && *p >= '0' && *p <= '9')
+    {
+        v = v * 10 + (*p++ - '0');
+        if(v > INT32_MAX)
+            return false;
+    }
+    *out = neg ? -v : v;
+    *pp = p;
+    return true;
+}
+
+/* decimal with optional fraction and exponent; the file isn't NUL
+ * terminated, so strtod() can't be let loose on it */
+static bool parse_scalar(const char **pp, const char *end, scalar *out)
+{
+    static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+                                    1e20, 1e21, 1e22 };
+    const char *p = *pp;
+    bool neg = false;
+    if(p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+
+    uint64_t mant = 0;
+    int exp = 0, digits = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; ++p, ++digits)
+    {
+        if(mant < UINT64_MAX / 10 - 9)
+            mant = mant * 10 + (*p - '0');
+        else
+            ++exp;
+    }
+    if(p < end && *p == '.')
+    {
+        for(++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits)
+        {
+            if(mant < UINT64_MAX / 10 - 9)
+            {
+                mant = mant * 10 + (*p - '0');
+                --exp;
+            }
+        }
+    }
+    if(!digits)
+        return false;
+    if(p < end && (*p == 'e' || *p == 'E'))
+    {
+        ++p;
+        long e;
+        if(!parse_int(&p, end, &e))
+            return false;
+        exp += e;
+    }
+
+    double v = mant;
+    if(exp < 0)
+        v = -exp <= 22 ? v / pow10[-exp] : v * pow(10, exp);
+    else if(exp > 0)
+        v = exp <= 22 ? v * pow10[exp] : v * pow(10, exp);
+    *out = neg ? -v : v;
+    *pp = p;
+    return true;
+}
+
+/* one face corner, "v", "v/vt", "v//vn" or "v/vt/vn"; only v is kept,
+ * made zero-based. negative indices count back from the latest vertex */
+static bool parse_corner(const char **pp, const char *end, int verts_so_far, int *out)
+{
+    long v;
+    if(!parse_int(pp, end, &v) || v == 0)
+        return false;
+    const char *p = *pp;
+    if(p < end && !is_space(*p) && *p != '/')
+        return false;
+    while(p < end && !is_space(*p))
+        ++p;
+    *pp = p;
+    *out = v > 0 ? v - 1 : verts_so_far + v;
+    return true;
+}
+
+/* the first pass: lines, vertices and triangles in a chunk */
+static void count_chunk(struct obj_chunk_t *c)
+{
+    for(const char *line = c->start; line < c->end; ++c->n_lines)
+    {
+        const char *eol = line_end(line, c->end);
+        const char *p = skip_space(line, eol);
+        if(keyword(p, eol, "v", 1))
+            ++c->n_verts;
+        else if(keyword(p, eol, "f", 1))
+        {
+            /* a face of n corners is n - 2 triangles */
+            int corners = 0;
+            for(p += 1; (p = skip_space(p, eol)) < eol; ++corners)
+                while(p < eol && !is_space(*p))
+                    ++p;
+            if(corners >= 3)
+                c->n_tris += corners - 2;
+        }
+        line = eol < c->end ? eol + 1 : eol;
+    }
+}
+
+/* the second pass */
+static void parse_chunk(struct obj_chunk_t *c)
+{
+    struct mesh_t *mesh = c->mesh;
+    int vert = c->first_vert, tri = c->first_tri, line_no = c->first_line;
+
+    for(const char *line = c->start; line < c->end; ++line_no)
+    {
+        const char *eol = line_end(line, c->end);
+        const char *p = skip_space(line, eol);
+        bool ok = true;
+        if(keyword(p, eol, "v", 1))
+        {
+            /* a fourth coordinate (w) is ignored */
+            scalar xyz[3];
+            p += 1;
+            for(int a = 0; a < 3 && ok; ++a)
+            {
+                p = skip_space(p, eol);
+                ok = parse_scalar(&p, eol, xyz + a);
+            }
+            if(ok)
+                mesh->verts[vert++] = vec3_make(xyz[0], xyz[1], xyz[2]);
+        }
+        else if(keyword(p, eol, "f", 1))
+        {
+            int first = 0, prev = 0, corners = 0;
+            for(p += 1; (p = skip_space(p, eol)) < eol; ++corners)
+            {
+                int v;
+                ok = parse_corner(&p, eol, vert, &v) && v >= 0 && v < mesh->n_verts;
+                if(!ok)
+                    break;
+                if(corners == 0)
+                    first = v;
+                else if(corners >= 2)
+                {
+                    int *idx = mesh->indices + 3 * tri++;
+                    idx[0] = first;
+                    idx[1] = prev;
+                    idx[2] = v;
+                }
+                prev = v;
+            }
+            if(corners < 3)
+                ok = false;
+        }
+        if(!ok && !c->bad_line)
+            c->bad_line = line_no;
+        line = eol < c->end ? eol + 1 : eol;
+    }
+}
+
+static void *obj_worker(void *ptr)
+{
+    struct obj_job_t *job = ptr;
+    int i;
+    while((i = __sync_fetch_and_add(&job->next, 1)) < job->n_chunks)
+    {
+        if(job->parse)
+            parse_chunk(job->chunks + i);
+        else
+            count_chunk(job->chunks + i);
+    }
+    return NULL;
+}
+
+static void run_pass(struct obj_job_t *job, bool parse, int n_threads)
+{
+    job->parse = parse;
+    job->next = 0;
+
+    pthread_t threads[n_threads];
+    for(int i = 1; i < n_threads; ++i)
+        pthread_create(threads + i, NULL, obj_worker, job);
+    obj_worker(job);
+    for(int i = 1; i < n_threads; ++i)
+        pthread_join(threads[i], NULL);
+}
+
+bool load_obj(const char *path, struct mesh_t *mesh, int n_threads)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0)
+    {
+        perror(path);
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    const char *data = NULL;
+    if(size)
+    {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED)
+        {
+            perror(path);
+            close(fd);
+            return false;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    if(n_threads < 1)
+        n_threads = 1;
+
+    /* cut into chunks that each end just after a newline */
+    int n_chunks = n_threads * CHUNKS_PER_THREAD;
+    struct obj_chunk_t *chunks = calloc(n_chunks, sizeof(struct obj_chunk_t));
+    const char *p = data, *end = data + size;
+    for(int i = 0; i < n_chunks; ++i)
+    {
+        const char *stop = data + size * (i + 1) / n_chunks;
+        if(stop <= p)
+            stop = p;
+        else if(stop < end)
+        {
+            stop = line_end(stop - 1, end);
+            stop = stop < end ? stop + 1 : end;
+        }
+        chunks[i].start = p;
+        chunks[i].end = stop;
+        p = stop;
+    }
+
+    struct obj_job_t job = { chunks, n_chunks };
+    run_pass(&job, false, n_threads);
+
+    struct mesh_t out;
+    int n_lines = 0;
+    out.n_verts = 0;
+    out.n_tris = 0;
+    for(int i = 0; i < n_chunks; ++i)
+    {
+        chunks[i].first_line = n_lines + 1;
+        chunks[i].first_vert = out.n_verts;
+        chunks[i].first_tri = out.n_tris;
+        chunks[i].mesh = &out;
+        n_lines += chunks[i].n_lines;
+        out.n_verts += chunks[i].n_verts;
+        out.n_tris += chunks[i].n_tris;
+    }
+    out.verts = malloc(sizeof(vec3) * (out.n_verts ? out.n_verts : 1));
+    out.indices = malloc(sizeof(int) * 3 * (out.n_tris ? out.n_tris : 1));
+    out.color = (struct rgb_t) { 0xc0, 0xc0, 0xc0 };
+    out.specularity = 0;
+
+    run_pass(&job, true, n_threads);
+
+    if(size)
+        munmap((void *)data, size);
+
+    for(int i = 0; i < n_chunks; ++i)
+    {
+        if(chunks[i].bad_line)
+        {
+            fprintf(stderr, "%s:%d: bad vertex or face\n", path, chunks[i].bad_line);
+            free(chunks);
+            free_mesh(&out);
+            return false;
+        }
+    }
+    free(chunks);
+
+    *mesh = out;
+    return true;
+}
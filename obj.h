@@ -0,0 +1,17 @@
+#ifndef OBJ_H
+#define OBJ_H
+
+#include <stdbool.h>
+
+#include "scene.h"
+
+/* reads the vertices and faces of a Wavefront OBJ file into mesh;
+ * faces with more than three corners are split into fans, and
+ * everything else (normals, texture coordinates, groups, materials) is
+ * skipped. the file is mapped rather than read, and split between
+ * n_threads threads to parse. the mesh comes back grey and matte, to
+ * be freed with free_mesh(); on failure it is left alone, a message
+ * goes to stderr and false is returned */
+bool load_obj(const char *path, struct mesh_t *mesh, int n_threads);
+
+#endif
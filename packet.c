@@ -0,0 +1,210 @@
+#include <assert.h>
+#include <limits.h>
+
+#include "counters.h"
+#include "packet.h"
+
+/* AVX-512 implies FMA, and a fused multiply-add rounds differently
+ * from the separate multiply and add that the scalar code does */
+#pragma GCC optimize("fp-contract=off")
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+/* SSE4.1: 4 lanes */
+#define PK(name) name##_sse
+#define PK_W 4
+#define PK_TARGET __attribute__((target("sse4.1")))
+#define pkf __m128
+#define pkm __m128
+#define pki __m128i
+#define pk_zero() _mm_setzero_ps()
+#define pk_set1(x) _mm_set1_ps(x)
+#define pk_load(p) _mm_loadu_ps(p)
+#define pk_store(p, v) _mm_storeu_ps(p, v)
+#define pk_add(a, b) _mm_add_ps(a, b)
+#define pk_sub(a, b) _mm_sub_ps(a, b)
+#define pk_mul(a, b) _mm_mul_ps(a, b)
+#define pk_div(a, b) _mm_div_ps(a, b)
+#define pk_sqrt(a) _mm_sqrt_ps(a)
+#define pk_neg(a) _mm_xor_ps(a, _mm_set1_ps(-0.f))
+#define pk_min(a, b) _mm_min_ps(a, b)
+#define pk_max(a, b) _mm_max_ps(a, b)
+#define pk_lt(a, b) _mm_cmplt_ps(a, b)
+#define pk_le(a, b) _mm_cmple_ps(a, b)
+#define pk_gt(a, b) _mm_cmpgt_ps(a, b)
+#define pk_eq(a, b) _mm_cmpeq_ps(a, b)
+#define pk_true() _mm_castsi128_ps(_mm_set1_epi32(-1))
+#define pk_false() _mm_setzero_ps()
+#define pk_and(a, b) _mm_and_ps(a, b)
+#define pk_or(a, b) _mm_or_ps(a, b)
+#define pk_andnot(a, b) _mm_andnot_ps(b, a) /* a & ~b */
+#define pk_select(m, a, b) _mm_blendv_ps(b, a, m)
+#define pk_bits(m) _mm_movemask_ps(m)
+#define pk_any(m) (pk_bits(m) != 0)
+#define pki_set1(x) _mm_set1_epi32(x)
+#define pki_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define pki_store(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define pki_eq(a, b) _mm_castsi128_ps(_mm_cmpeq_epi32(a, b))
+#define pki_lt(a, b) _mm_castsi128_ps(_mm_cmplt_epi32(a, b))
+#define pki_select(m, a, b) _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(b), _mm_castsi128_ps(a), m))
+#include "packet_kernel.h"
+
+/* AVX2: 8 lanes */
+#define PK(name) name##_avx2
+#define PK_W 8
+#define PK_TARGET __attribute__((target("avx2")))
+#define pkf __m256
+#define pkm __m256
+#define pki __m256i
+#define pk_zero() _mm256_setzero_ps()
+#define pk_set1(x) _mm256_set1_ps(x)
+#define pk_load(p) _mm256_loadu_ps(p)
+#define pk_store(p, v) _mm256_storeu_ps(p, v)
+#define pk_add(a, b) _mm256_add_ps(a, b)
+#define pk_sub(a, b) _mm256_sub_ps(a, b)
+#define pk_mul(a, b) _mm256_mul_ps(a, b)
+#define pk_div(a, b) _mm256_div_ps(a, b)
+#define pk_sqrt(a) _mm256_sqrt_ps(a)
+#define pk_neg(a) _mm256_xor_ps(a, _mm256_set1_ps(-0.f))
+#define pk_min(a, b) _mm256_min_ps(a, b)
+#define pk_max(a, b) _mm256_max_ps(a, b)
+#define pk_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define pk_le(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define pk_gt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define pk_eq(a, b) _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define pk_true() _mm256_castsi256_ps(_mm256_set1_epi32(-1))
+#define pk_false() _mm256_setzero_ps()
+#define pk_and(a, b) _mm256_and_ps(a, b)
+#define pk_or(a, b) _mm256_or_ps(a, b)
+#define pk_andnot(a, b) _mm256_andnot_ps(b, a)
+#define pk_select(m, a, b) _mm256_blendv_ps(b, a, m)
+#define pk_bits(m) _mm256_movemask_ps(m)
+#define pk_any(m) (pk_bits(m) != 0)
+#define pki_set1(x) _mm256_set1_epi32(x)
+#define pki_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define pki_store(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define pki_eq(a, b) _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b))
+#define pki_lt(a, b) _mm256_castsi256_ps(_mm256_cmpgt_epi32(b, a))
+#define pki_select(m, a, b) _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b), _mm256_castsi256_ps(a), m))
+#include "packet_kernel.h"
+
+/* AVX-512: 16 lanes, with real mask registers */
+#define PK(name) name##_avx512
+#define PK_W 16
+#define PK_TARGET __attribute__((target("avx512f")))
+#define pkf __m512
+#define pkm __mmask16
+#define pki __m512i
+#define pk_zero() _mm512_setzero_ps()
+#define pk_set1(x) _mm512_set1_ps(x)
+#define pk_load(p) _mm512_loadu_ps(p)
+#define pk_store(p, v) _mm512_storeu_ps(p, v)
+#define pk_add(a, b) _mm512_add_ps(a, b)
+#define pk_sub(a, b) _mm512_sub_ps(a, b)
+#define pk_mul(a, b) _mm512_mul_ps(a, b)
+#define pk_div(a, b) _mm512_div_ps(a, b)
+#define pk_sqrt(a) _mm512_sqrt_ps(a)
+#define pk_neg(a) _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32(0x80000000)))
+#define pk_min(a, b) _mm512_min_ps(a, b)
+#define pk_max(a, b) _mm512_max_ps(a, b)
+#define pk_lt(a, b) _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ)
+#define pk_le(a, b) _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ)
+#define pk_gt(a, b) _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ)
+#define pk_eq(a, b) _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ)
+#define pk_true() ((__mmask16)0xffff)
+#define pk_false() ((__mmask16)0)
+#define pk_and(a, b) ((__mmask16)((a) & (b)))
+#define pk_or(a, b) ((__mmask16)((a) | (b)))
+#define pk_andnot(a, b) ((__mmask16)((a) & ~(b)))
+#define pk_select(m, a, b) _mm512_mask_blend_ps(m, b, a)
+#define pk_bits(m) ((int)(m))
+#define pk_any(m) ((m) != 0)
+#define pki_set1(x) _mm512_set1_epi32(x)
+#define pki_load(p) _mm512_loadu_si512(p)
+#define pki_store(p, v) _mm512_storeu_si512(p, v)
+#define pki_eq(a, b) _mm512_cmpeq_epi32_mask(a, b)
+#define pki_lt(a, b) _mm512_cmplt_epi32_mask(a, b)
+#define pki_select(m, a, b) _mm512_mask_blend_epi32(m, b, a)
+#include "packet_kernel.h"
+
+int packet_width(void)
+{
+    static int width = -1;
+    if(width < 0)
+    {
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx512f"))
+            width = 16;
+        else if(__builtin_cpu_supports("avx2"))
+            width = 8;
+        else if(__builtin_cpu_supports("sse4.1"))
+            width = 4;
+        else
+            width = 0;
+    }
+    return width;
+}
+
+void packet_intersections(const struct scene_t *scene, const struct ray_packet_t *p, int width,
+                          int *hit, scalar *dist)
+{
+    switch(width)
+    {
+    case 16:
+        intersections_avx512(scene, p, hit, dist);
+        break;
+    case 8:
+        intersections_avx2(scene, p, hit, dist);
+        break;
+    case 4:
+        intersections_sse(scene, p, hit, dist);
+        break;
+    default:
+        assert(false);
+    }
+}
+
+void packet_occluded(const struct scene_t *scene, const struct ray_packet_t *p, int width,
+                     bool *occluded)
+{
+    switch(width)
+    {
+    case 16:
+        occluded_avx512(scene, p, occluded);
+        break;
+    case 8:
+        occluded_avx2(scene, p, occluded);
+        break;
+    case 4:
+        occluded_sse(scene, p, occluded);
+        break;
+    default:
+        assert(false);
+    }
+}
+
+#else
+
+/* no SIMD kernels for this architecture: callers see a width of 0
+ * and stay on the scalar path */
+
+int packet_width(void)
+{
+    return 0;
+}
+
+void packet_intersections(const struct scene_t *scene, const struct ray_packet_t *p, int width,
+                          int *hit, scalar *dist)
+{
+    assert(false);
+}
+
+void packet_occluded(const struct scene_t *scene, const struct ray_packet_t *p, int width,
+                     bool *occluded)
+{
+    assert(false);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdbool.h>
+
+#include "scene.h"
+
+/* widest packet any kernel handles (AVX-512) */
+#define PACKET_MAX 16
+
+/* a bundle of rays traced together, one per SIMD lane */
+struct ray_packet_t {
+    scalar ox[PACKET_MAX], oy[PACKET_MAX], oz[PACKET_MAX];
+    scalar dx[PACKET_MAX], dy[PACKET_MAX], dz[PACKET_MAX];
+    scalar max_t[PACKET_MAX]; /* only hits closer than this count; <= 0 disables the lane */
+    int avoid[PACKET_MAX];    /* handle of an object to ignore, or -1 */
+} __attribute__((aligned(64)));
+
+/* widest packet the running CPU supports: 16 (AVX-512), 8 (AVX2),
+ * 4 (SSE4.1), or 0 if there is no SIMD kernel for it */
+int packet_width(void);
+
+/* in all of these, width must be 4, 8 or 16 and no wider than
+ * packet_width(); only the first width lanes are read */
+
+static inline void packet_set(struct ray_packet_t *p, int lane, vec3 o, vec3 d, scalar max_t, int avoid)
+{
+    p->ox[lane] = o.x;
+    p->oy[lane] = o.y;
+    p->oz[lane] = o.z;
+    p->dx[lane] = d.x;
+    p->dy[lane] = d.y;
+    p->dz[lane] = d.z;
+    p->max_t[lane] = max_t;
+    p->avoid[lane] = avoid;
+}
+
+/* nearest hit per lane, with the same tie-breaking as
+ * scene_intersections(); hit[i] is an object handle or -1 */
+void packet_intersections(const struct scene_t *scene, const struct ray_packet_t *p, int width,
+                          int *hit, scalar *dist);
+
+/* per-lane scene_occluded() using each lane's max_t as the distance */
+void packet_occluded(const struct scene_t *scene, const struct ray_packet_t *p, int width,
+                     bool *occluded);
+
+#endif
@@ -0,0 +1,346 @@
+/* packet traversal and intersection, written once against the pk_*
+ * macros and included by packet.c for each instruction set it
+ * supports; no include guard on purpose, and the macros are
+ * undefined again at the bottom so the next width can define its own
+ *
+ * each kernel mirrors its scalar counterpart in scene.c operation for
+ * operation, including which comparisons reject a hit, so a lane
+ * gives bit-for-bit the answer the scalar path would */
+
+struct PK(rays_t) {
+    pkf o[3], d[3], inv_d[3];
+};
+
+static inline PK_TARGET void PK(load_rays)(struct PK(rays_t) *r, const struct ray_packet_t *p)
+{
+    r->o[0] = pk_load(p->ox);
+    r->o[1] = pk_load(p->oy);
+    r->o[2] = pk_load(p->oz);
+    r->d[0] = pk_load(p->dx);
+    r->d[1] = pk_load(p->dy);
+    r->d[2] = pk_load(p->dz);
+    for(int a = 0; a < 3; ++a)
+        r->inv_d[a] = pk_div(pk_set1(1), r->d[a]);
+}
+
+/* slab test, see ray_hits_box(); argument order of the min/max
+ * matters, since it decides what a NaN turns into */
+static inline PK_TARGET pkm PK(box)(const struct aabb_t *box, const struct PK(rays_t) *r,
+                                    pkf t_max, pkf *t_near)
+{
+    COUNT(packet_box_tests);
+    pkf t_min = pk_zero();
+    for(int a = 0; a < 3; ++a)
+    {
+        pkf t0 = pk_mul(pk_sub(pk_set1(box->min[a]), r->o[a]), r->inv_d[a]),
+            t1 = pk_mul(pk_sub(pk_set1(box->max[a]), r->o[a]), r->inv_d[a]);
+        t_min = pk_max(pk_min(t1, t0), t_min);
+        t_max = pk_min(pk_max(t1, t0), t_max);
+    }
+    *t_near = t_min;
+    return pk_le(t_min, t_max);
+}
+
+static inline PK_TARGET pkf PK(dot)(pkf ax, pkf ay, pkf az, pkf bx, pkf by, pkf bz)
+{
+    return pk_add(pk_add(pk_mul(ax, bx), pk_mul(ay, by)), pk_mul(az, bz));
+}
+
+/* sphere_intersects() for every lane; returns the lanes that hit */
+static inline PK_TARGET pkm PK(sphere)(const struct sphere_array_t *s, int i, const struct PK(rays_t) *r, pkf *t)
+{
+    COUNT(packet_prim_tests);
+    const pkf zero = pk_zero();
+    pkf ocx = pk_sub(r->o[0], pk_set1(s->x[i])),
+        ocy = pk_sub(r->o[1], pk_set1(s->y[i])),
+        ocz = pk_sub(r->o[2], pk_set1(s->z[i]));
+    pkf a = PK(dot)(r->d[0], r->d[1], r->d[2], r->d[0], r->d[1], r->d[2]),
+        b = pk_mul(pk_set1(2), PK(dot)(ocx, ocy, ocz, r->d[0], r->d[1], r->d[2])),
+        c = pk_sub(PK(dot)(ocx, ocy, ocz, ocx, ocy, ocz), pk_set1(s->r2[i]));
+    pkf disc = pk_sub(pk_mul(b, b), pk_mul(pk_mul(pk_set1(4), a), c));
+    pkm hit = pk_andnot(pk_true(), pk_lt(disc, zero));
+    pkf sq = pk_sqrt(disc), two_a = pk_mul(pk_set1(2), a);
+    pkf t1 = pk_div(pk_sub(pk_neg(b), sq), two_a),
+        t2 = pk_div(pk_add(pk_neg(b), sq), two_a);
+    hit = pk_andnot(hit, pk_and(pk_lt(t1, zero), pk_lt(t2, zero)));
+    /* starting inside the sphere takes the far root */
+    pkm inside = pk_lt(pk_mul(t1, t2), zero);
+    *t = pk_select(inside, pk_max(t1, t2), pk_min(t1, t2));
+    return hit;
+}
+
+static inline PK_TARGET pkm PK(plane)(const struct plane_array_t *p, int i, const struct PK(rays_t) *r, pkf *t)
+{
+    COUNT(packet_prim_tests);
+    const pkf zero = pk_zero();
+    pkf nx = pk_set1(p->nx[i]), ny = pk_set1(p->ny[i]), nz = pk_set1(p->nz[i]);
+    pkf denom = PK(dot)(nx, ny, nz, r->d[0], r->d[1], r->d[2]);
+    pkf t1 = pk_div(PK(dot)(nx, ny, nz,
+                            pk_sub(pk_set1(p->px[i]), r->o[0]),
+                            pk_sub(pk_set1(p->py[i]), r->o[1]),
+                            pk_sub(pk_set1(p->pz[i]), r->o[2])), denom);
+    pkm hit = pk_andnot(pk_true(), pk_or(pk_eq(denom, zero), pk_le(t1, zero)));
+    *t = t1;
+    return hit;
+}
+
+static inline PK_TARGET pkm PK(tri)(const struct tri_array_t *tri, int i, const struct PK(rays_t) *r, pkf *t)
+{
+    COUNT(packet_prim_tests);
+    const pkf zero = pk_zero(), one = pk_set1(1);
+    const struct tri_record_t *rec = tri->rec + i;
+    pkf e1x = pk_set1(rec->e1[0]), e1y = pk_set1(rec->e1[1]), e1z = pk_set1(rec->e1[2]),
+        e2x = pk_set1(rec->e2[0]), e2y = pk_set1(rec->e2[1]), e2z = pk_set1(rec->e2[2]);
+    pkf px = pk_sub(pk_mul(r->d[1], e2z), pk_mul(r->d[2], e2y)),
+        py = pk_sub(pk_mul(r->d[2], e2x), pk_mul(r->d[0], e2z)),
+        pz = pk_sub(pk_mul(r->d[0], e2y), pk_mul(r->d[1], e2x));
+    pkf det = PK(dot)(e1x, e1y, e1z, px, py, pz);
+    pkf inv_det = pk_div(one, det);
+
+    pkf sx = pk_sub(r->o[0], pk_set1(rec->v0[0])),
+        sy = pk_sub(r->o[1], pk_set1(rec->v0[1])),
+        sz = pk_sub(r->o[2], pk_set1(rec->v0[2]));
+    pkf u = pk_mul(PK(dot)(sx, sy, sz, px, py, pz), inv_det);
+    pkf qx = pk_sub(pk_mul(sy, e1z), pk_mul(sz, e1y)),
+        qy = pk_sub(pk_mul(sz, e1x), pk_mul(sx, e1z)),
+        qz = pk_sub(pk_mul(sx, e1y), pk_mul(sy, e1x));
+    pkf v = pk_mul(PK(dot)(r->d[0], r->d[1], r->d[2], qx, qy, qz), inv_det);
+    pkf t1 = pk_mul(PK(dot)(e2x, e2y, e2z, qx, qy, qz), inv_det);
+
+    pkm hit = pk_andnot(pk_true(), pk_eq(det, zero));
+    hit = pk_andnot(hit, pk_or(pk_lt(u, zero), pk_gt(u, one)));
+    hit = pk_andnot(hit, pk_or(pk_lt(v, zero), pk_gt(pk_add(u, v), one)));
+    hit = pk_andnot(hit, pk_le(t1, zero));
+    *t = t1;
+    return hit;
+}
+
+/* keep_nearest() for a packet: the nearest hit wins, lowest handle on ties */
+static inline PK_TARGET void PK(nearest)(int id, pkm hit, pkf t, pki avoid,
+                                         pkf *best_t, pki *best_i)
+{
+    pki handle = pki_set1(id);
+    hit = pk_andnot(hit, pki_eq(handle, avoid));
+    pkm closer = pk_or(pk_lt(t, *best_t), pk_and(pk_eq(t, *best_t), pki_lt(handle, *best_i)));
+    hit = pk_and(hit, closer);
+    *best_t = pk_select(hit, t, *best_t);
+    *best_i = pki_select(hit, handle, *best_i);
+}
+
+static PK_TARGET void PK(intersections)(const struct scene_t *scene, const struct ray_packet_t *p,
+                                        int *hit, scalar *dist)
+{
+    COUNT(packets);
+    struct PK(rays_t) r;
+    PK(load_rays)(&r, p);
+    pki avoid = pki_load(p->avoid);
+    pkf best_t = pk_load(p->max_t), t, t_near, t_left, t_right;
+    pki best_i = pki_set1(INT_MAX);
+    pkm active = pk_gt(best_t, pk_zero());
+
+    const struct sphere_array_t *s = &scene->spheres;
+    const struct plane_array_t *pl = &scene->planes;
+    const struct tri_array_t *tri = &scene->tris;
+
+    for(int i = 0; i < pl->n; ++i)
+    {
+        pkm hit = pk_and(active, PK(plane)(pl, i, &r, &t));
+        PK(nearest)(pl->id[i], hit, t, avoid, &best_t, &best_i);
+    }
+
+    if(scene->n_world_nodes && pk_any(pk_and(active, PK(box)(&scene->bvh[0].bounds, &r, best_t, &t_near))))
+    {
+        int stack[BVH_STACK_SIZE], sp = 0;
+        int idx = 0;
+
+        while(1)
+        {
+            const struct bvh_node_t *node = scene->bvh + idx;
+            if(bvh_is_leaf(node))
+            {
+                for(int i = node->offset; i < node->offset + node->n_spheres; ++i)
+                {
+                    pkm hit = pk_and(active, PK(sphere)(s, i, &r, &t));
+                    PK(nearest)(s->id[i], hit, t, avoid, &best_t, &best_i);
+                }
+                for(int i = node->first_tri; i < node->first_tri + node->n_tris; ++i)
+                {
+                    pkm hit = pk_and(active, PK(tri)(tri, i, &r, &t));
+                    PK(nearest)(tri->id[i], hit, t, avoid, &best_t, &best_i);
+                }
+            }
+            else
+            {
+                int left = idx + 1, right = node->offset;
+                pkm hit_left = pk_and(active, PK(box)(&scene->bvh[left].bounds, &r, best_t, &t_left)),
+                    hit_right = pk_and(active, PK(box)(&scene->bvh[right].bounds, &r, best_t, &t_right));
+                bool any_left = pk_any(hit_left), any_right = pk_any(hit_right);
+                if(any_left && any_right)
+                {
+                    /* go where most of the lanes that see both say is nearer */
+                    pkm both = pk_and(hit_left, hit_right);
+                    int n_both = __builtin_popcount(pk_bits(both)),
+                        n_right = __builtin_popcount(pk_bits(pk_and(both, pk_lt(t_right, t_left))));
+                    if(2 * n_right > n_both)
+                    {
+                        stack[sp++] = left;
+                        idx = right;
+                    }
+                    else
+                    {
+                        stack[sp++] = right;
+                        idx = left;
+                    }
+                    continue;
+                }
+                else if(any_left)
+                {
+                    idx = left;
+                    continue;
+                }
+                else if(any_right)
+                {
+                    idx = right;
+                    continue;
+                }
+            }
+
+            bool found = false;
+            while(sp)
+            {
+                idx = stack[--sp];
+                if(pk_any(pk_and(active, PK(box)(&scene->bvh[idx].bounds, &r, best_t, &t_near))))
+                {
+                    found = true;
+                    break;
+                }
+            }
+            if(!found)
+                break;
+        }
+    }
+
+    pk_store(dist, best_t);
+    pki_store(hit, best_i);
+    /* instances are one lane at a time, each in its own object space;
+     * INT_MAX with the lane's max_t is a miss instances_nearest() can
+     * go on from */
+    if(scene->n_instance_nodes)
+        for(int k = 0; k < PK_W; ++k)
+            if(p->max_t[k] > 0)
+                instances_nearest(scene, vec3_make(p->ox[k], p->oy[k], p->oz[k]),
+                                  vec3_make(p->dx[k], p->dy[k], p->dz[k]), p->avoid[k], dist + k, hit + k);
+    for(int k = 0; k < PK_W; ++k)
+        if(hit[k] == INT_MAX)
+        {
+            hit[k] = -1;
+            dist[k] = -1;
+        }
+}
+
+/* marks the lanes in hit that are blocked closer than max_t by object
+ * id; returns the lanes still unoccluded */
+static inline PK_TARGET pkm PK(block)(int id, pkm hit, pkf t, pki avoid, pkf max_t,
+                                      pkm active, pkm *occluded)
+{
+    hit = pk_and(pk_andnot(hit, pki_eq(pki_set1(id), avoid)), pk_lt(t, max_t));
+    *occluded = pk_or(*occluded, hit);
+    return pk_andnot(active, hit);
+}
+
+static PK_TARGET void PK(occluded)(const struct scene_t *scene, const struct ray_packet_t *p,
+                                   bool *occluded)
+{
+    COUNT(packets);
+    struct PK(rays_t) r;
+    PK(load_rays)(&r, p);
+    pki avoid = pki_load(p->avoid);
+    pkf max_t = pk_load(p->max_t), t, t_near;
+    pkm active = pk_gt(max_t, pk_zero()), blocked = pk_false();
+
+    const struct sphere_array_t *s = &scene->spheres;
+    const struct plane_array_t *pl = &scene->planes;
+    const struct tri_array_t *tri = &scene->tris;
+
+    for(int i = 0; i < pl->n && pk_any(active); ++i)
+    {
+        pkm hit = pk_and(active, PK(plane)(pl, i, &r, &t));
+        active = PK(block)(pl->id[i], hit, t, avoid, max_t, active, &blocked);
+    }
+
+    if(scene->n_world_nodes && pk_any(active))
+    {
+        int stack[BVH_STACK_SIZE], sp = 0;
+        stack[sp++] = 0;
+        while(sp && pk_any(active))
+        {
+            const struct bvh_node_t *node = scene->bvh + stack[--sp];
+            if(!pk_any(pk_and(active, PK(box)(&node->bounds, &r, max_t, &t_near))))
+                continue;
+            if(bvh_is_leaf(node))
+            {
+                for(int i = node->offset; i < node->offset + node->n_spheres && pk_any(active); ++i)
+                {
+                    pkm hit = pk_and(active, PK(sphere)(s, i, &r, &t));
+                    active = PK(block)(s->id[i], hit, t, avoid, max_t, active, &blocked);
+                }
+                for(int i = node->first_tri; i < node->first_tri + node->n_tris && pk_any(active); ++i)
+                {
+                    pkm hit = pk_and(active, PK(tri)(tri, i, &r, &t));
+                    active = PK(block)(tri->id[i], hit, t, avoid, max_t, active, &blocked);
+                }
+            }
+            else
+            {
+                stack[sp++] = node->offset;
+                stack[sp++] = node - scene->bvh + 1;
+            }
+        }
+    }
+
+    int bits = pk_bits(blocked);
+    for(int k = 0; k < PK_W; ++k)
+        occluded[k] = (bits >> k) & 1;
+    if(scene->n_instance_nodes)
+        for(int k = 0; k < PK_W; ++k)
+            if(!occluded[k] && p->max_t[k] > 0)
+                occluded[k] = instances_occluded(scene, vec3_make(p->ox[k], p->oy[k], p->oz[k]),
+                                                 vec3_make(p->dx[k], p->dy[k], p->dz[k]), p->max_t[k], p->avoid[k]);
+}
+
+#undef PK
+#undef PK_W
+#undef PK_TARGET
+#undef pkf
+#undef pkm
+#undef pki
+#undef pk_zero
+#undef pk_set1
+#undef pk_load
+#undef pk_store
+#undef pk_add
+#undef pk_sub
+#undef pk_mul
+#undef pk_div
+#undef pk_sqrt
+#undef pk_neg
+#undef pk_min
+#undef pk_max
+#undef pk_lt
+#undef pk_le
+#undef pk_gt
+#undef pk_eq
+#undef pk_true
+#undef pk_false
+#undef pk_and
+#undef pk_or
+#undef pk_andnot
+#undef pk_select
+#undef pk_bits
+#undef pk_any
+#undef pki_set1
+#undef pki_load
+#undef pki_store
+#undef pki_eq
+#undef pki_lt
+#undef pki_select
@@ -0,0 +1,1452 @@
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "packet.h"
+#include "render.h"
+
+/* side of the square blocks of pixels handed out to workers */
+#define TILE_SIZE 16
+
+/* group each bounce's reflection rays by direction in wavefront mode */
+#define SORT_QUEUES
+
+#ifdef COUNTERS
+/* paths are counted by how many bounces they had left when they ended,
+ * which is all the hot path knows; a worker adds them to its depths,
+ * by reflections followed, when it finishes its part of a band */
+static __thread long paths_left[MAX_BOUNCES + 1];
+#define COUNT_PATH(left) (paths_left[left]++)
+#else
+#define COUNT_PATH(left) ((void)0)
+#endif
+
+/* return the direction of the reflected ray */
+vec3 reflect_ray(vec3 d, vec3 normal)
+{
+    scalar c = -2 * vec3_dot(d, normal);
+    return vec3_add(vec3_mul(normal, c), d);
+}
+
+struct rgb_t blend(struct rgb_t a, struct rgb_t b, unsigned char alpha)
+{
+    struct rgb_t ret;
+    unsigned char r1, g1, b1;
+    ret.r = (((int)a.r * alpha) + ((int)b.r * (255 - alpha))) / 255;
+    ret.g = (((int)a.g * alpha) + ((int)b.g * (255 - alpha))) / 255;
+    ret.b = (((int)a.b * alpha) + ((int)b.b * (255 - alpha))) / 255;
+    return ret;
+}
+
+/* background seen by rays that escape the scene */
+struct rgb_t sky_color(vec3 d)
+{
+    scalar elevation = atan2(d.y, sqrt(d.x*d.x + d.z*d.z));
+    return blend((struct rgb_t) {0, 0x96, 0xff}, (struct rgb_t) { 0xfe, 0xfe, 0xfe },
+                 ABS(elevation * 2 / M_PI * 255));
+}
+
+/* diffuse contribution of one unoccluded light */
+scalar light_shade(const struct light_t *light, vec3 normal, vec3 light_dir, scalar light_dist)
+{
+    scalar shade = vec3_dot(normal, light_dir);
+    if(shade > 0)
+        return shade * light->intensity * 1 / SQR(light_dist);
+    return 0;
+}
+
+/* the lights to send shadow rays to from one hit, walked off the light
+ * tree, with what each one's shade is to be scaled by */
+struct light_iter_t {
+    const struct scene_t *scene;
+    vec3 pt, normal;
+    scalar reach2;    /* squared distance past which lights are skipped */
+    bool sampling;    /* else walking the whole tree */
+    int samples_left;
+    scalar scale;
+    unsigned rng;
+    int stack[BVH_STACK_SIZE];
+    int sp;
+};
+
+/* false if every light in the node is behind the surface, where
+ * light_shade() would give nothing */
+static inline bool light_node_facing(const struct light_node_t *node, vec3 pt, vec3 normal)
+{
+    /* the corner of the box furthest along the normal */
+    vec3 corner = vec3_make(normal.x > 0 ? node->bounds.max[0] : node->bounds.min[0],
+                            normal.y > 0 ? node->bounds.max[1] : node->bounds.min[1],
+                            normal.z > 0 ? node->bounds.max[2] : node->bounds.min[2]);
+    return vec3_dot(normal, vec3_sub(corner, pt)) > 0;
+}
+
+/* squared distance from pt to the nearest point of the node's box */
+static inline scalar light_node_dist2(const struct light_node_t *node, vec3 pt)
+{
+    scalar p[3] = { pt.x, pt.y, pt.z }, d2 = 0;
+    for(int a = 0; a < 3; ++a)
+        d2 += SQR(MAX(MAX(node->bounds.min[a] - p[a], p[a] - node->bounds.max[a]), 0));
+    return d2;
+}
+
+/* a guess at the node's share of the light at pt, for sampling; it
+ * only has to be 0 where the true share is, and the closer it is the
+ * less noise there is */
+static inline scalar light_node_importance(const struct light_node_t *node, vec3 pt, vec3 normal)
+{
+    if(!light_node_facing(node, pt, normal))
+        return 0;
+    scalar p[3] = { pt.x, pt.y, pt.z }, d2 = 0, r2 = 0;
+    for(int a = 0; a < 3; ++a)
+    {
+        d2 += SQR(.5 * (node->bounds.min[a] + node->bounds.max[a]) - p[a]);
+        r2 += SQR(.5 * (node->bounds.max[a] - node->bounds.min[a]));
+    }
+    return node->intensity / MAX(MAX(d2, r2), 1e-6);
+}
+
+/* a hash of the hit point and the pass's seed, so every render mode
+ * picks the same lights for the same hit */
+static inline unsigned light_seed(vec3 pt, unsigned seed)
+{
+    unsigned h[3];
+    memcpy(h, &pt, sizeof(h));
+    return (h[0] * 0x9e3779b1u ^ h[1] * 0x85ebca77u ^ h[2] * 0xc2b2ae3du ^ seed * 0x27d4eb2fu) | 1;
+}
+
+static inline scalar light_rand(struct light_iter_t *it)
+{
+    it->rng ^= it->rng << 13;
+    it->rng ^= it->rng >> 17;
+    it->rng ^= it->rng << 5;
+    return it->rng / 4294967296.;
+}
+
+static void lights_begin(struct light_iter_t *it, const struct scene_t *scene, vec3 pt, vec3 normal,
+                         scalar weight, const struct render_opts_t *opts)
+{
+    it->scene = scene;
+    it->pt = pt;
+    it->normal = normal;
+    /* shade moves a pixel by at most weight * (1 - ambient) steps, and
+     * a group of lights of intensity i at distance d at most
+     * |normal| * i / d^2, since the normal isn't unit length. giving
+     * each group a share of the cutoff in proportion to its intensity,
+     * the skipped groups can't add up to more than the cutoff, and
+     * what's left is a distance: lights further away than
+     * sqrt(|normal| * total intensity / cutoff) are dropped */
+    scalar cutoff = opts->light_cutoff / (weight * (1 - scene->ambient));
+    it->reach2 = scene->n_light_nodes && cutoff > 0 ?
+        vec3_abs(normal) * scene->light_bvh[0].intensity / cutoff : INFINITY;
+    it->sampling = opts->light_samples > 0;
+    it->samples_left = opts->light_samples;
+    it->scale = opts->light_samples ? 1. / opts->light_samples : 1;
+    it->rng = light_seed(pt, opts->seed);
+    it->sp = 0;
+    if(scene->n_light_nodes)
+        it->stack[it->sp++] = 0;
+}
+
+/* one descent of the tree, taking each branch in proportion to its
+ * importance; returns the light and its shade scale, or false if no
+ * light could add anything */
+static bool sample_light(struct light_iter_t *it, int *light, scalar *scale)
+{
+    const struct light_node_t *nodes = it->scene->light_bvh;
+    int idx = 0;
+    scalar pdf = 1;
+    if(!light_node_importance(nodes, it->pt, it->normal))
+        return false;
+    while(!nodes[idx].leaf)
+    {
+        int left = idx + 1, right = nodes[idx].offset;
+        scalar a = light_node_importance(nodes + left, it->pt, it->normal),
+            b = light_node_importance(nodes + right, it->pt, it->normal);
+        if(a + b <= 0)
+            return false;
+        if(light_rand(it) * (a + b) < a)
+        {
+            idx = left;
+            pdf *= a / (a + b);
+        }
+        else
+        {
+            idx = right;
+            pdf *= b / (a + b);
+        }
+    }
+    *light = nodes[idx].offset;
+    *scale = it->scale / pdf;
+    return true;
+}
+
+/* the next light to shade with and its scale, or false once there are
+ * no more */
+static bool lights_next(struct light_iter_t *it, int *light, scalar *scale)
+{
+    if(it->sampling)
+    {
+        while(it->sp && it->samples_left)
+        {
+            --it->samples_left;
+            if(sample_light(it, light, scale))
+                return true;
+        }
+        return false;
+    }
+
+    const struct light_node_t *nodes = it->scene->light_bvh;
+    while(it->sp)
+    {
+        int idx = it->stack[--it->sp];
+        const struct light_node_t *node = nodes + idx;
+        if(!light_node_facing(node, it->pt, it->normal) || light_node_dist2(node, it->pt) > it->reach2)
+            continue;
+        if(node->leaf)
+        {
+            *light = node->offset;
+            *scale = 1;
+            return true;
+        }
+        it->stack[it->sp++] = node->offset;
+        it->stack[it->sp++] = idx + 1;
+    }
+    return false;
+}
+
+struct rgb_t trace_ray(const struct scene_t *scene, vec3 orig, vec3 d, int max_iters, int avoid,
+                       scalar weight, const struct render_opts_t *opts, struct render_stats_t *stats);
+
+/* colour of the surface of a hit under its summed light, before any
+ * reflection is blended in */
+struct rgb_t surface_color(const struct scene_t *scene, int hit, scalar shade_total)
+{
+    struct rgb_t primary = scene_material(scene, hit)->color;
+
+    if(shade_total > 1)
+        shade_total = 1;
+
+    scalar diffuse = 1 - scene->ambient;
+    primary.r *= (scene->ambient + diffuse * shade_total);
+    primary.g *= (scene->ambient + diffuse * shade_total);
+    primary.b *= (scene->ambient + diffuse * shade_total);
+    return primary;
+}
+
+/* weight of the reflection off a surface that blends in with alpha
+ * specular, given the weight of the ray that hit it */
+static inline scalar reflected_weight(scalar weight, int specular)
+{
+    return weight * (255 - specular) / 255;
+}
+
+/* colour of a hit given its summed light; follows the reflection
+ * unless it could no longer move the pixel by a whole 8-bit step */
+struct rgb_t shade_hit(const struct scene_t *scene, vec3 pt, vec3 d, vec3 normal,
+                       int hit, scalar shade_total, int max_iters, scalar weight,
+                       const struct render_opts_t *opts, struct render_stats_t *stats)
+{
+    struct rgb_t reflected = {0, 0, 0};
+
+    int specular = 255 - scene_material(scene, hit)->specularity;
+    scalar ref_weight = reflected_weight(weight, specular);
+    /* reflections */
+    if(specular != 255 && max_iters > 0 && ref_weight >= 1)
+    {
+        vec3 ref = reflect_ray(d, normal);
+        stats->reflections++;
+        reflected = trace_ray(scene, pt, ref, max_iters - 1, hit, ref_weight, opts, stats);
+    }
+    else
+        COUNT_PATH(max_iters);
+
+    return blend(surface_color(scene, hit, shade_total), reflected, specular);
+}
+
+/* weight is as in struct render_opts_t, for this ray rather than the
+ * camera's; the shadow and reflection rays it spawns are counted in
+ * stats */
+struct rgb_t trace_ray(const struct scene_t *scene, vec3 orig, vec3 d, int max_iters, int avoid,
+                       scalar weight, const struct render_opts_t *opts, struct render_stats_t *stats)
+{
+    scalar hit_dist; /* distance from camera in terms of d */
+    int hit = scene_intersections(scene, orig, d, &hit_dist, avoid);
+
+    if(hit < 0)
+    {
+        COUNT_PATH(max_iters);
+        return sky_color(d);
+    }
+
+    /* shade */
+
+    vec3 pt = vec3_add(vec3_mul(d, hit_dist), orig);
+
+    vec3 normal = normal_at_point(scene, hit, pt);
+
+    scalar shade_total = 0;
+
+    struct light_iter_t lights;
+    int i;
+    scalar scale;
+    lights_begin(&lights, scene, pt, normal, weight, opts);
+    while(lights_next(&lights, &i, &scale))
+    {
+        /* get vector to light */
+        vec3 light_dir = vec3_sub(scene->lights[i].position, pt);
+
+        scalar light_dist = vec3_abs(light_dir);
+
+        light_dir = vec3_normalize(light_dir);
+
+        /* see if light is occluded */
+        stats->shadow++;
+        if(scene_occluded(scene, pt, light_dir, light_dist, hit))
+            continue;
+
+        shade_total += scale * light_shade(scene->lights + i, normal, light_dir, light_dist);
+    }
+
+    return shade_hit(scene, pt, d, normal, hit, shade_total, max_iters, weight, opts, stats);
+}
+
+/* trace_ray() for the first n lanes of a packet of primary rays: the
+ * camera hit and each round of shadow rays go through the SIMD
+ * kernels, and reflections then continue one ray at a time */
+void trace_packet(const struct scene_t *scene, struct ray_packet_t *rays, int width, int n,
+                  int max_iters, scalar weight, const struct render_opts_t *opts,
+                  struct render_stats_t *stats, struct rgb_t *colors)
+{
+    int hit[PACKET_MAX];
+    scalar hit_dist[PACKET_MAX], shade_total[PACKET_MAX];
+    vec3 d[PACKET_MAX], pt[PACKET_MAX], normal[PACKET_MAX];
+
+    for(int k = 0; k < width; ++k)
+    {
+        rays->max_t[k] = k < n ? INFINITY : 0;
+        rays->avoid[k] = -1;
+    }
+
+    packet_intersections(scene, rays, width, hit, hit_dist);
+
+    for(int k = 0; k < n; ++k)
+    {
+        d[k] = vec3_make(rays->dx[k], rays->dy[k], rays->dz[k]);
+        if(hit[k] < 0)
+            continue;
+        vec3 orig = vec3_make(rays->ox[k], rays->oy[k], rays->oz[k]);
+        pt[k] = vec3_add(vec3_mul(d[k], hit_dist[k]), orig);
+        normal[k] = normal_at_point(scene, hit[k], pt[k]);
+        shade_total[k] = 0;
+    }
+
+    /* each lane walks its own lights, and every round sends the next
+     * shadow ray of each lane that has one left */
+    struct light_iter_t lights[PACKET_MAX];
+    for(int k = 0; k < n; ++k)
+        if(hit[k] >= 0)
+            lights_begin(lights + k, scene, pt[k], normal[k], weight, opts);
+
+    struct ray_packet_t shadow;
+    bool occluded[PACKET_MAX];
+    int light[PACKET_MAX];
+    scalar scale[PACKET_MAX];
+    while(1)
+    {
+        bool any = false;
+        for(int k = 0; k < width; ++k)
+        {
+            if(k >= n || hit[k] < 0 || !lights_next(lights + k, light + k, scale + k))
+            {
+                light[k] = -1;
+                packet_set(&shadow, k, vec3_make(0, 0, 0), vec3_make(0, 0, 1), 0, -1);
+                continue;
+            }
+            vec3 light_dir = vec3_sub(scene->lights[light[k]].position, pt[k]);
+            scalar light_dist = vec3_abs(light_dir);
+            packet_set(&shadow, k, pt[k], vec3_normalize(light_dir), light_dist, hit[k]);
+            stats->shadow++;
+            any = true;
+        }
+        if(!any)
+            break;
+
+        packet_occluded(scene, &shadow, width, occluded);
+
+        for(int k = 0; k < n; ++k)
+        {
+            if(light[k] < 0 || occluded[k])
+                continue;
+            vec3 light_dir = vec3_make(shadow.dx[k], shadow.dy[k], shadow.dz[k]);
+            shade_total[k] += scale[k] * light_shade(scene->lights + light[k], normal[k], light_dir, shadow.max_t[k]);
+        }
+    }
+
+    for(int k = 0; k < n; ++k)
+    {
+        if(hit[k] < 0)
+        {
+            COUNT_PATH(max_iters);
+            colors[k] = sky_color(d[k]);
+        }
+        else
+            colors[k] = shade_hit(scene, pt[k], d[k], normal[k], hit[k], shade_total[k], max_iters,
+                                  weight, opts, stats);
+    }
+}
+
+/* renders the rectangle [x0, x1) x [y0, y1) of the image seen from
+ * view, a pixel (or packet of them) at a time */
+void render_lines(const struct framebuffer_t *fb,
+                  const struct scene_t *scene,
+                  const struct camera_view_t *view,
+                  int x0, int y0, int x1, int y1,
+                  const struct render_opts_t *opts, struct render_stats_t *stats)
+{
+    int packet = opts->packet;
+    vec3 d[PACKET_MAX];
+
+    stats->primary += (x1 - x0) * (y1 - y0);
+
+    for(int y = y0; y < y1; ++y)
+    {
+        if(packet)
+        {
+            /* runs of neighbouring pixels on a row are coherent enough
+             * to share a traversal */
+            struct ray_packet_t rays;
+            struct rgb_t colors[PACKET_MAX];
+            for(int x = x0; x < x1; x += packet)
+            {
+                int n = MIN(packet, x1 - x);
+                camera_row(view, x, y, n, d);
+                for(int k = 0; k < n; ++k)
+                    packet_set(&rays, k, view->origin, d[k], 0, -1);
+                for(int k = n; k < packet; ++k)
+                    packet_set(&rays, k, view->origin, vec3_make(0, 0, 1), 0, -1);
+
+                trace_packet(scene, &rays, packet, n, opts->bounces, opts->weight, opts, stats, colors);
+                fb_write_row(fb, x, y, colors, n);
+            }
+            continue;
+        }
+
+        for(int x = x0; x < x1; x += PACKET_MAX)
+        {
+            int n = MIN(PACKET_MAX, x1 - x);
+            camera_row(view, x, y, n, d);
+
+            /* view->origin and d[k] form the camera ray */
+            struct rgb_t colors[PACKET_MAX];
+            for(int k = 0; k < n; ++k)
+                colors[k] = trace_ray(scene, view->origin, d[k], opts->bounces, -1, opts->weight, opts, stats);
+            fb_write_row(fb, x, y, colors, n);
+        }
+    }
+}
+
+/* the wavefront renderer: instead of following each pixel's path down
+ * through its reflections, a whole tile's rays are pushed through one
+ * stage at a time (intersect, shade, shadow), and the reflections they
+ * spawn form the queue for the next pass */
+
+static const char *stage_names[N_STAGES] = { "generate", "intersect", "shade", "shadow", "sort" };
+
+/* a ray waiting to be intersected */
+struct wave_ray_t {
+    vec3 o, d;
+    int avoid;
+    int path;      /* pixel within the tile it contributes to */
+    scalar weight; /* as in struct render_opts_t, for this ray */
+};
+
+/* what a queued ray hit, kept until the shadow rays are resolved */
+struct wave_hit_t {
+    int hit;
+    scalar dist;
+    vec3 pt, normal;
+    scalar shade_total;
+};
+
+struct wave_shadow_t {
+    vec3 o, d;
+    scalar dist, scale;
+    int ray, light;
+    bool occluded;
+};
+
+/* surface colours along one pixel's path; they are blended back to
+ * front once the path ends, rounding exactly as trace_ray() does */
+struct wave_path_t {
+    int depth;
+    struct rgb_t tail; /* sky if the path escaped, else black */
+    struct rgb_t color[MAX_BOUNCES + 1];
+    unsigned char alpha[MAX_BOUNCES + 1];
+};
+
+/* per-worker scratch space, sized for one tile */
+struct wavefront_t {
+    struct wave_ray_t *rays, *next;
+    struct wave_hit_t *hits;
+    struct wave_shadow_t *shadows;
+    int shadow_cap;
+    struct wave_path_t *paths;
+};
+
+struct wavefront_t *wavefront_create(void)
+{
+    struct wavefront_t *wf = calloc(1, sizeof(struct wavefront_t));
+    wf->rays = malloc(sizeof(struct wave_ray_t) * SQR(TILE_SIZE));
+    wf->next = malloc(sizeof(struct wave_ray_t) * SQR(TILE_SIZE));
+    wf->hits = malloc(sizeof(struct wave_hit_t) * SQR(TILE_SIZE));
+    wf->paths = malloc(sizeof(struct wave_path_t) * SQR(TILE_SIZE));
+    return wf;
+}
+
+void wavefront_destroy(struct wavefront_t *wf)
+{
+    free(wf->rays);
+    free(wf->next);
+    free(wf->hits);
+    free(wf->shadows);
+    free(wf->paths);
+    free(wf);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* charges the time since *t to a stage and restarts the clock */
+static void stage_done(struct render_stats_t *stats, int stage, int n_rays, double *t)
+{
+    double t1 = now();
+    stats->rays[stage] += n_rays;
+    stats->secs[stage] += t1 - *t;
+    *t = t1;
+}
+
+static void wave_intersect(const struct scene_t *scene, const struct wave_ray_t *rays,
+                           struct wave_hit_t *hits, int n, int packet)
+{
+    if(!packet)
+    {
+        for(int i = 0; i < n; ++i)
+            hits[i].hit = scene_intersections(scene, rays[i].o, rays[i].d, &hits[i].dist, rays[i].avoid);
+        return;
+    }
+
+    struct ray_packet_t p;
+    int hit[PACKET_MAX];
+    scalar dist[PACKET_MAX];
+    for(int i = 0; i < n; i += packet)
+    {
+        int m = MIN(packet, n - i);
+        for(int k = 0; k < packet; ++k)
+        {
+            if(k < m)
+                packet_set(&p, k, rays[i + k].o, rays[i + k].d, INFINITY, rays[i + k].avoid);
+            else
+                packet_set(&p, k, vec3_make(0, 0, 0), vec3_make(0, 0, 1), 0, -1);
+        }
+        packet_intersections(scene, &p, packet, hit, dist);
+        for(int k = 0; k < m; ++k)
+        {
+            hits[i + k].hit = hit[k];
+            hits[i + k].dist = dist[k];
+        }
+    }
+}
+
+static void wave_occluded(const struct scene_t *scene, const struct wave_hit_t *hits,
+                          struct wave_shadow_t *shadows, int n, int packet)
+{
+    if(!packet)
+    {
+        for(int i = 0; i < n; ++i)
+        {
+            struct wave_shadow_t *s = shadows + i;
+            s->occluded = scene_occluded(scene, s->o, s->d, s->dist, hits[s->ray].hit);
+        }
+        return;
+    }
+
+    struct ray_packet_t p;
+    bool occluded[PACKET_MAX];
+    for(int i = 0; i < n; i += packet)
+    {
+        int m = MIN(packet, n - i);
+        for(int k = 0; k < packet; ++k)
+        {
+            if(k < m)
+                packet_set(&p, k, shadows[i + k].o, shadows[i + k].d, shadows[i + k].dist, hits[shadows[i + k].ray].hit);
+            else
+                packet_set(&p, k, vec3_make(0, 0, 0), vec3_make(0, 0, 1), 0, -1);
+        }
+        packet_occluded(scene, &p, packet, occluded);
+        for(int k = 0; k < m; ++k)
+            shadows[i + k].occluded = occluded[k];
+    }
+}
+
+#ifdef SORT_QUEUES
+/* counting sort by direction octant, so rays heading the same way are
+ * intersected together */
+static void sort_rays(const struct wave_ray_t *in, struct wave_ray_t *out, int n)
+{
+    int start[9] = { 0 };
+    for(int i = 0; i < n; ++i)
+    {
+        int oct = (in[i].d.x < 0) | (in[i].d.y < 0) << 1 | (in[i].d.z < 0) << 2;
+        start[oct + 1]++;
+    }
+    for(int i = 1; i < 9; ++i)
+        start[i] += start[i - 1];
+    for(int i = 0; i < n; ++i)
+    {
+        int oct = (in[i].d.x < 0) | (in[i].d.y < 0) << 1 | (in[i].d.z < 0) << 2;
+        out[start[oct]++] = in[i];
+    }
+}
+#endif
+
+/* renders the rectangle [x0, x1) x [y0, y1), which must fit in a tile,
+ * to the same pixels render_lines() would give */
+void render_wavefront(const struct framebuffer_t *fb,
+                      const struct scene_t *scene,
+                      const struct camera_view_t *view,
+                      int x0, int y0, int x1, int y1,
+                      const struct render_opts_t *opts, struct wavefront_t *wf,
+                      struct render_stats_t *stats)
+{
+    int packet = opts->packet;
+    int tw = x1 - x0, n_paths = tw * (y1 - y0);
+    assert(tw <= TILE_SIZE && n_paths <= SQR(TILE_SIZE));
+
+    double t = now();
+
+    for(int i = 0; i < n_paths; ++i)
+    {
+        struct wave_ray_t *r = wf->rays + i;
+        r->o = view->origin;
+        r->d = camera_ray(view, x0 + i % tw, y0 + i / tw);
+        r->avoid = -1;
+        r->path = i;
+        r->weight = opts->weight;
+        wf->paths[i].depth = 0;
+    }
+    stats->primary += n_paths;
+    stage_done(stats, STAGE_GENERATE, n_paths, &t);
+
+    int n = n_paths;
+    for(int depth = 0; n; ++depth)
+    {
+        wave_intersect(scene, wf->rays, wf->hits, n, packet);
+        stage_done(stats, STAGE_INTERSECT, n, &t);
+
+        /* find the surface point and queue its shadow rays */
+        int n_shadows = 0;
+        for(int i = 0; i < n; ++i)
+        {
+            const struct wave_ray_t *r = wf->rays + i;
+            struct wave_hit_t *hit = wf->hits + i;
+            if(hit->hit < 0)
+            {
+                wf->paths[r->path].tail = sky_color(r->d);
+                COUNT_PATH(opts->bounces - depth);
+                continue;
+            }
+            hit->pt = vec3_add(vec3_mul(r->d, hit->dist), r->o);
+            hit->normal = normal_at_point(scene, hit->hit, hit->pt);
+            hit->shade_total = 0;
+
+            struct light_iter_t lights;
+            int l;
+            scalar scale;
+            lights_begin(&lights, scene, hit->pt, hit->normal, r->weight, opts);
+            while(lights_next(&lights, &l, &scale))
+            {
+                /* how many lights a hit gets isn't known up front */
+                if(n_shadows == wf->shadow_cap)
+                {
+                    wf->shadow_cap = wf->shadow_cap ? 2 * wf->shadow_cap : SQR(TILE_SIZE);
+                    wf->shadows = realloc(wf->shadows, sizeof(struct wave_shadow_t) * wf->shadow_cap);
+                }
+                struct wave_shadow_t *s = wf->shadows + n_shadows++;
+                vec3 light_dir = vec3_sub(scene->lights[l].position, hit->pt);
+                s->o = hit->pt;
+                s->dist = vec3_abs(light_dir);
+                s->d = vec3_normalize(light_dir);
+                s->scale = scale;
+                s->ray = i;
+                s->light = l;
+            }
+        }
+        stage_done(stats, STAGE_SHADE, n, &t);
+
+        wave_occluded(scene, wf->hits, wf->shadows, n_shadows, packet);
+        stats->shadow += n_shadows;
+        stage_done(stats, STAGE_SHADOW, n_shadows, &t);
+
+        /* shadows for a ray are queued in the order its light walk
+         * gave them, so the light sums the same way as in trace_ray() */
+        for(int i = 0; i < n_shadows; ++i)
+        {
+            const struct wave_shadow_t *s = wf->shadows + i;
+            struct wave_hit_t *hit = wf->hits + s->ray;
+            if(!s->occluded)
+                hit->shade_total += s->scale * light_shade(scene->lights + s->light, hit->normal, s->d, s->dist);
+        }
+
+        /* record each surface and queue its reflection */
+        int n_next = 0;
+        for(int i = 0; i < n; ++i)
+        {
+            const struct wave_ray_t *r = wf->rays + i;
+            const struct wave_hit_t *hit = wf->hits + i;
+            if(hit->hit < 0)
+                continue;
+            struct wave_path_t *path = wf->paths + r->path;
+            int specular = 255 - scene_material(scene, hit->hit)->specularity;
+            scalar ref_weight = reflected_weight(r->weight, specular);
+            path->color[path->depth] = surface_color(scene, hit->hit, hit->shade_total);
+            path->alpha[path->depth] = specular;
+            path->depth++;
+
+            if(specular != 255 && depth < opts->bounces && ref_weight >= 1)
+            {
+                struct wave_ray_t *ref = wf->next + n_next++;
+                ref->o = hit->pt;
+                ref->d = reflect_ray(r->d, hit->normal);
+                ref->avoid = hit->hit;
+                ref->path = r->path;
+                ref->weight = ref_weight;
+            }
+            else
+            {
+                path->tail = (struct rgb_t) { 0, 0, 0 };
+                COUNT_PATH(opts->bounces - depth);
+            }
+        }
+        stage_done(stats, STAGE_SHADE, 0, &t);
+
+        n = n_next;
+        stats->reflections += n;
+#ifdef SORT_QUEUES
+        sort_rays(wf->next, wf->rays, n);
+        stage_done(stats, STAGE_SORT, n, &t);
+#else
+        struct wave_ray_t *tmp = wf->rays;
+        wf->rays = wf->next;
+        wf->next = tmp;
+#endif
+    }
+
+    struct rgb_t row[TILE_SIZE];
+    for(int i = 0; i < n_paths; ++i)
+    {
+        const struct wave_path_t *path = wf->paths + i;
+        struct rgb_t color = path->tail;
+        for(int d = path->depth - 1; d >= 0; --d)
+            color = blend(path->color[d], color, path->alpha[d]);
+        row[i % tw] = color;
+        if(i % tw == tw - 1)
+            fb_write_row(fb, x0, y0 + i / tw, row, tw);
+    }
+    stage_done(stats, STAGE_SHADE, 0, &t);
+}
+
+/* state shared by all workers rendering one band of rows */
+struct render_job_t {
+    const struct framebuffer_t *fb;
+    const struct scene_t *scene;
+    const struct camera_view_t *view;
+    struct render_opts_t opts;
+    int y0, y1;
+    int tiles_x, n_tiles;
+    int next_tile; /* claimed with an atomic increment */
+    int tiles_done;
+    /* antialiasing goes over the band twice more once it is drawn:
+     * first marking the edges in mask, one byte a pixel, then
+     * supersampling them. each pass needs the one before it finished,
+     * since marking reads across tiles and supersampling writes */
+    enum { PHASE_DRAW, PHASE_EDGES, PHASE_SUPERSAMPLE } phase;
+    int n_phases;
+    unsigned char *mask;
+};
+
+/* one per worker, written only by it during a frame; aligned so that
+ * no two workers' counters share a cache line */
+struct renderinfo_t {
+    struct render_pool_t *pool;
+    int worker;
+    struct wavefront_t *wave;
+    struct render_stats_t stats;
+    double band_busy;
+} __attribute__((aligned(64)));
+
+/* long-lived workers that sleep on a condition variable between
+ * frames, so a frame costs one broadcast and no allocation */
+struct render_pool_t {
+    int n_threads;
+    pthread_t *threads;
+    struct renderinfo_t *info;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start, finish;
+    struct render_job_t job;
+    unsigned frame; /* bumped for each job */
+    int busy;       /* workers yet to finish the current job */
+    bool quit;
+    double started; /* when the current job went out */
+    size_t mask_size;
+};
+
+static void add_counters(struct counters_t *total, const struct counters_t *c)
+{
+    total->nearest += c->nearest;
+    total->occlusion += c->occlusion;
+    total->occluded += c->occluded;
+    total->box_tests += c->box_tests;
+    total->prim_tests += c->prim_tests;
+    total->packets += c->packets;
+    total->packet_box_tests += c->packet_box_tests;
+    total->packet_prim_tests += c->packet_prim_tests;
+}
+
+/* one frame's primary hits, by pixel; handle -1 is the sky */
+struct reproject_frame_t {
+    struct camera_view_t view; /* just the projection, no tables */
+    int *handle;
+    vec3 *pt;
+    struct rgb_t *color;
+    size_t size;
+};
+
+struct reproject_t {
+    struct reproject_frame_t frame[2];
+    int cur;        /* frame being drawn; the other is the last one */
+    bool have_last;
+    unsigned frame_no;
+};
+
+/* a rotating pattern of one pixel in REFRESH_PERIOD is shaded afresh
+ * every frame; a power of two */
+#define REFRESH_PERIOD 16
+
+struct reproject_t *reproject_create(void)
+{
+    return calloc(1, sizeof(struct reproject_t));
+}
+
+void reproject_reset(struct reproject_t *cache)
+{
+    cache->have_last = false;
+}
+
+void reproject_free(struct reproject_t *cache)
+{
+    for(int i = 0; i < 2; ++i)
+    {
+        free(cache->frame[i].handle);
+        free(cache->frame[i].pt);
+        free(cache->frame[i].color);
+    }
+    free(cache);
+}
+
+/* called with the pool idle before a frame's first band: what was being
+ * drawn becomes the last frame */
+static void reproject_begin(struct reproject_t *cache, const struct camera_view_t *view)
+{
+    if(cache->frame_no++)
+    {
+        cache->cur ^= 1;
+        cache->have_last = true;
+    }
+
+    struct reproject_frame_t *f = &cache->frame[cache->cur];
+    size_t size = (size_t)view->w * view->h;
+    if(size > f->size)
+    {
+        f->handle = realloc(f->handle, sizeof(int) * size);
+        f->pt = realloc(f->pt, sizeof(vec3) * size);
+        f->color = realloc(f->color, sizeof(struct rgb_t) * size);
+        f->size = size;
+    }
+    f->view = *view;
+    f->view.sin_az = f->view.cos_az = f->view.cos_el = f->view.sin_el = NULL;
+}
+
+/* the draw phase with a reprojection cache: each pixel's primary hit is
+ * found first, and if the last frame saw the same object within a
+ * couple of pixels' width of it, and the object doesn't reflect (so its
+ * colour doesn't depend on where it is seen from), the old colour
+ * stands. everything else goes through trace_ray(), one ray at a time */
+static void render_reprojected(const struct render_job_t *job, int x0, int y0, int x1, int y1,
+                               struct render_stats_t *stats)
+{
+    const struct scene_t *scene = job->scene;
+    const struct camera_view_t *view = job->view;
+    const struct render_opts_t *opts = &job->opts;
+    struct reproject_t *cache = opts->reproject;
+    struct reproject_frame_t *cur = &cache->frame[cache->cur];
+    const struct reproject_frame_t *last = cache->have_last ? &cache->frame[cache->cur ^ 1] : NULL;
+    /* radians across a pixel, now and then */
+    double angle = MAX(ABS(view->daz), ABS(view->del));
+    if(last)
+        angle = MAX(angle, MAX(ABS(last->view.daz), ABS(last->view.del)));
+
+    stats->primary += (x1 - x0) * (y1 - y0);
+
+    for(int y = y0; y < y1; ++y)
+    {
+        struct rgb_t row[TILE_SIZE];
+        for(int x = x0; x < x1; ++x)
+        {
+            vec3 d = camera_ray(view, x, y);
+            scalar dist;
+            int hit = scene_intersections(scene, view->origin, d, &dist, -1);
+            vec3 pt = vec3_add(view->origin, vec3_mul(d, dist));
+
+            int lx, ly;
+            bool reuse = last && hit >= 0 &&
+                ((x * 3 + y * 5 + cache->frame_no) & (REFRESH_PERIOD - 1)) &&
+                !scene_material(scene, hit)->specularity &&
+                camera_project(&last->view, pt, &lx, &ly);
+            size_t q = 0;
+            if(reuse)
+            {
+                q = (size_t)ly * last->view.w + lx;
+                reuse = last->handle[q] == hit &&
+                    vec3_abs(vec3_sub(last->pt[q], pt)) <= 2 * angle * vec3_abs(vec3_sub(pt, view->origin));
+            }
+
+            struct rgb_t color;
+            if(reuse)
+            {
+                color = last->color[q];
+                stats->reused++;
+            }
+            else
+                color = trace_ray(scene, view->origin, d, opts->bounces, -1, opts->weight, opts, stats);
+
+            size_t p = (size_t)y * view->w + x;
+            cur->handle[p] = hit;
+            cur->pt[p] = pt;
+            cur->color[p] = color;
+            row[x - x0] = color;
+        }
+        fb_write_row(job->fb, x0, y, row, x1 - x0);
+    }
+}
+
+/* a pixel is an edge if a neighbour sees a different object, or a
+ * colour more than aa_contrast steps off in any channel. objects are
+ * found again with a query per pixel, plus a border of one around the
+ * tile; colours are only compared within the band */
+static void find_edges(const struct render_job_t *job, int x0, int y0, int x1, int y1)
+{
+    const struct camera_view_t *view = job->view;
+    int w = view->w;
+    /* the tile and a border of one; ids of -2 are off the image, and
+     * colours are only there for rows in the band */
+    int ids[TILE_SIZE + 2][TILE_SIZE + 2];
+    struct rgb_t colors[TILE_SIZE + 2][TILE_SIZE + 2];
+    int cx0 = MAX(x0 - 1, 0), cx1 = MIN(x1 + 1, w);
+    for(int y = y0 - 1; y <= y1; ++y)
+    {
+        if(y >= job->y0 && y < job->y1)
+            fb_read_row(job->fb, cx0, y, cx1 - cx0, &colors[y - y0 + 1][cx0 - x0 + 1]);
+        for(int x = x0 - 1; x <= x1; ++x)
+        {
+            int *id = &ids[y - y0 + 1][x - x0 + 1];
+            scalar dist;
+            if(x < 0 || x >= w || y < 0 || y >= view->h)
+                *id = -2;
+            else
+                *id = scene_intersections(job->scene, view->origin, camera_ray(view, x, y), &dist, -1);
+        }
+    }
+
+    static const int dx[4] = { -1, 1, 0, 0 }, dy[4] = { 0, 0, -1, 1 };
+    for(int y = y0; y < y1; ++y)
+        for(int x = x0; x < x1; ++x)
+        {
+            int i = y - y0 + 1, j = x - x0 + 1;
+            const unsigned char *px = &colors[i][j].r;
+            bool edge = false;
+            for(int n = 0; n < 4 && !edge; ++n)
+            {
+                int nid = ids[i + dy[n]][j + dx[n]];
+                if(nid == -2)
+                    continue;
+                edge = nid != ids[i][j];
+                if(y + dy[n] < job->y0 || y + dy[n] >= job->y1)
+                    continue;
+                const unsigned char *npx = &colors[i + dy[n]][j + dx[n]].r;
+                for(int c = 0; c < 3; ++c)
+                    edge |= ABS(npx[c] - px[c]) > job->opts.aa_contrast;
+            }
+            job->mask[(size_t)(y - job->y0) * w + x] = edge;
+        }
+}
+
+/* jitter in [0, 1) for one sub-pixel sample, the same every frame */
+static inline scalar aa_jitter(unsigned x, unsigned y, unsigned s, unsigned seed)
+{
+    unsigned h = (x * 0x9e3779b1u ^ y * 0x85ebca77u ^ s * 0xc2b2ae3du ^ seed * 0x27d4eb2fu) | 1;
+    h ^= h << 13;
+    h ^= h >> 17;
+    h ^= h << 5;
+    return h / 4294967296.;
+}
+
+/* replaces each marked pixel with the average of aa x aa rays, one
+ * from a random spot in each cell of an aa x aa grid over the pixel */
+static void supersample(const struct render_job_t *job, int x0, int y0, int x1, int y1,
+                        struct render_stats_t *stats)
+{
+    const struct camera_view_t *view = job->view;
+    const struct render_opts_t *opts = &job->opts;
+    int n = opts->aa;
+    for(int y = y0; y < y1; ++y)
+        for(int x = x0; x < x1; ++x)
+        {
+            size_t p = (size_t)(y - job->y0) * view->w + x;
+            if(!job->mask[p])
+                continue;
+
+            int sum[3] = { 0, 0, 0 };
+            for(int s = 0; s < n * n; ++s)
+            {
+                double sx = x - .5 + (s % n + aa_jitter(x, y, 2 * s, opts->seed)) / n;
+                double sy = y - .5 + (s / n + aa_jitter(x, y, 2 * s + 1, opts->seed)) / n;
+                struct rgb_t c = trace_ray(job->scene, view->origin, camera_subpixel(view, sx, sy),
+                                           opts->bounces, -1, opts->weight, opts, stats);
+                sum[0] += c.r;
+                sum[1] += c.g;
+                sum[2] += c.b;
+            }
+            struct rgb_t avg = { (sum[0] + n * n / 2) / (n * n),
+                                 (sum[1] + n * n / 2) / (n * n),
+                                 (sum[2] + n * n / 2) / (n * n) };
+            fb_write_row(job->fb, x, y, &avg, 1);
+            stats->supersampled++;
+        }
+}
+
+/* workers pull tiles off the shared counter until it runs out, so a
+ * thread that draws cheap tiles just ends up drawing more of them */
+void render_tiles(struct render_job_t *job, struct renderinfo_t *info)
+{
+#ifdef COUNTERS
+    double start = now();
+    memset(&counters, 0, sizeof(counters));
+    memset(paths_left, 0, sizeof(paths_left));
+#endif
+
+    int tile;
+    while((tile = __sync_fetch_and_add(&job->next_tile, 1)) < job->n_tiles)
+    {
+        int x0 = (tile % job->tiles_x) * TILE_SIZE, y0 = job->y0 + (tile / job->tiles_x) * TILE_SIZE;
+        int x1 = MIN(x0 + TILE_SIZE, job->view->w), y1 = MIN(y0 + TILE_SIZE, job->y1);
+        if(job->phase == PHASE_EDGES)
+        {
+            find_edges(job, x0, y0, x1, y1);
+            continue;
+        }
+        if(job->phase == PHASE_SUPERSAMPLE)
+        {
+            supersample(job, x0, y0, x1, y1, &info->stats);
+            continue;
+        }
+        if(job->opts.reproject)
+            render_reprojected(job, x0, y0, x1, y1, &info->stats);
+        else if(job->opts.wavefront)
+            render_wavefront(job->fb, job->scene, job->view, x0, y0, x1, y1,
+                             &job->opts, info->wave, &info->stats);
+        else
+            render_lines(job->fb, job->scene, job->view, x0, y0, x1, y1,
+                         &job->opts, &info->stats);
+
+        int done = __sync_add_and_fetch(&job->tiles_done, 1);
+        if(job->opts.progress)
+            printf("Worker %d: %d%% (%d/%d)\n", info->worker, 100 * done / job->n_tiles, done, job->n_tiles);
+    }
+
+#ifdef COUNTERS
+    add_counters(&info->stats.counters, &counters);
+    info->band_busy = now() - start;
+    info->stats.busy += info->band_busy;
+    /* bands can differ in bounces, so each is turned round by its own */
+    for(int left = 0; left <= job->opts.bounces; ++left)
+        info->stats.depth[job->opts.bounces - left] += paths_left[left];
+#endif
+}
+
+void *thread(void *ptr)
+{
+    struct renderinfo_t *info = ptr;
+    struct render_pool_t *pool = info->pool;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while(1)
+    {
+        while(pool->frame == seen && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if(pool->quit)
+            break;
+        seen = pool->frame;
+        struct render_job_t *job = &pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        render_tiles(job, info);
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->busy == 0)
+        {
+#ifdef COUNTERS
+            /* everyone else is done with the band, so their times are in */
+            double band = now() - pool->started;
+            for(int i = 0; i < pool->n_threads; ++i)
+                pool->info[i].stats.idle += band - pool->info[i].band_busy;
+            pool->started = now();
+#endif
+            /* the last one out sends everyone round the band again for
+             * the next phase, if there is one */
+            if(++job->phase < job->n_phases)
+            {
+                job->next_tile = 0;
+                pool->busy = pool->n_threads;
+                pool->frame++;
+                pthread_cond_broadcast(&pool->start);
+            }
+            else
+                pthread_cond_signal(&pool->finish);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int detect_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+struct render_pool_t *create_pool(int n_threads)
+{
+    if(n_threads <= 0)
+        n_threads = detect_threads();
+
+    struct render_pool_t *pool = malloc(sizeof(struct render_pool_t));
+    pool->n_threads = n_threads;
+    pool->threads = malloc(sizeof(pthread_t) * n_threads);
+    void *info;
+    if(posix_memalign(&info, 64, sizeof(struct renderinfo_t) * n_threads))
+        abort();
+    pool->info = info;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finish, NULL);
+    pool->frame = 0;
+    pool->busy = 0;
+    pool->quit = false;
+    pool->job.mask = NULL;
+    pool->mask_size = 0;
+
+    for(int i = 0; i < n_threads; ++i)
+    {
+        pool->info[i].pool = pool;
+        pool->info[i].worker = i;
+        pool->info[i].wave = wavefront_create();
+        pthread_create(pool->threads + i, NULL, thread, pool->info + i);
+    }
+    return pool;
+}
+
+void destroy_pool(struct render_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->n_threads; ++i)
+    {
+        pthread_join(pool->threads[i], NULL);
+        wavefront_destroy(pool->info[i].wave);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finish);
+    free(pool->threads);
+    free(pool->info);
+    free(pool->job.mask);
+    free(pool);
+}
+
+int pool_threads(const struct render_pool_t *pool)
+{
+    return pool->n_threads;
+}
+
+void render_rows(struct render_pool_t *pool, const struct framebuffer_t *fb,
+                 const struct scene_t *scene, const struct camera_view_t *view,
+                 int y0, int y1, const struct render_opts_t *opts)
+{
+    assert(opts->bounces <= MAX_BOUNCES);
+    assert(0 <= y0 && y0 < y1 && y1 <= view->h);
+    assert(fb->w >= view->w && fb->y0 <= y0 && y1 <= fb->y0 + fb->h);
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->busy)
+        pthread_cond_wait(&pool->finish, &pool->lock);
+
+    struct render_job_t *job = &pool->job;
+    job->fb = fb;
+    job->scene = scene;
+    job->view = view;
+    job->opts = *opts;
+    job->y0 = y0;
+    job->y1 = y1;
+    job->tiles_x = (view->w + TILE_SIZE - 1) / TILE_SIZE;
+    job->n_tiles = job->tiles_x * ((y1 - y0 + TILE_SIZE - 1) / TILE_SIZE);
+    job->next_tile = 0;
+    job->tiles_done = 0;
+    job->phase = PHASE_DRAW;
+    job->n_phases = opts->aa > 1 ? PHASE_SUPERSAMPLE + 1 : PHASE_DRAW + 1;
+    size_t mask_size = (size_t)view->w * (y1 - y0);
+    if(opts->aa > 1 && mask_size > pool->mask_size)
+    {
+        job->mask = realloc(job->mask, mask_size);
+        pool->mask_size = mask_size;
+    }
+
+    if(y0 == 0)
+    {
+        for(int i = 0; i < pool->n_threads; ++i)
+            memset(&pool->info[i].stats, 0, sizeof(struct render_stats_t));
+        if(opts->reproject)
+            reproject_begin(opts->reproject, view);
+    }
+#ifdef COUNTERS
+    pool->started = now();
+#endif
+    pool->busy = pool->n_threads;
+    pool->frame++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void render_wait(struct render_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(pool->busy)
+        pthread_cond_wait(&pool->finish, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void render_scene(struct render_pool_t *pool, const struct framebuffer_t *fb,
+                  const struct scene_t *scene,
+                  const struct camera_view_t *view, const struct render_opts_t *opts)
+{
+    render_rows(pool, fb, scene, view, 0, view->h, opts);
+    render_wait(pool);
+}
+
+/* previews trace one pixel in PREVIEW_STEP^2, then one in
+ * (PREVIEW_STEP / 4)^2, and so on down to full size */
+#define PREVIEW_STEP 16
+
+int render_progressive(struct render_pool_t *pool, const struct framebuffer_t *fb,
+                       const struct scene_t *scene,
+                       const struct camera_view_t *view, const struct render_opts_t *opts,
+                       int max_samples, scalar threshold, bool previews,
+                       bool (*pass_done)(const struct render_pass_t *pass, void *data), void *data)
+{
+    int w = view->w, h = view->h;
+    struct render_pass_t pass = { 0, 0, 0, 0 };
+    if(!opts->light_samples)
+        max_samples = 1;
+    /* a single full pass straight to fb needs no rows of its own */
+    struct rgb_t *row = NULL, *src = NULL;
+    if(previews || max_samples > 1)
+    {
+        row = malloc(sizeof(struct rgb_t) * w);
+        src = malloc(sizeof(struct rgb_t) * w);
+    }
+
+    bool go_on = true;
+    if(previews)
+    {
+        /* the preview views pick out pixels of the full one, so a
+         * preview pixel is exactly the one it stands in for */
+        struct camera_view_t coarse = { 0 };
+        struct render_opts_t preview_opts = *opts;
+        preview_opts.aa = 0;
+        preview_opts.reproject = NULL;
+        struct framebuffer_t small;
+        if(!fb_create(&small, (w + 3) / 4, (h + 3) / 4, FB_RGBA32))
+            abort();
+        for(pass.step = PREVIEW_STEP; go_on && pass.step > 1; pass.step /= 4, pass.pass++)
+        {
+            camera_view_subsample(&coarse, view, pass.step);
+            render_scene(pool, &small, scene, &coarse, &preview_opts);
+            for(int y = 0; y < h; ++y)
+            {
+                if(y % pass.step == 0)
+                {
+                    fb_read_row(&small, 0, y / pass.step, coarse.w, src);
+                    for(int x = 0; x < w; ++x)
+                        row[x] = src[x / pass.step];
+                }
+                fb_write_row(fb, 0, y, row, w);
+            }
+            go_on = pass_done(&pass, data);
+        }
+        camera_view_free(&coarse);
+        fb_free(&small);
+    }
+
+    /* full size: the average of passes with different seeds, which only
+     * differ if lights are sampled. a single pass goes straight to fb */
+    pass.step = 1;
+    if(go_on && max_samples == 1)
+    {
+        render_scene(pool, fb, scene, view, opts);
+        pass.samples = 1;
+        pass_done(&pass, data);
+    }
+    else if(go_on)
+    {
+        struct framebuffer_t frame, sum;
+        if(!fb_create(&frame, w, h, FB_RGBA32) || !fb_create(&sum, w, h, FB_FLOAT))
+            abort();
+        memset(sum.pixels, 0, sum.pitch * h);
+        struct render_opts_t pass_opts = *opts;
+        /* the passes are meant to differ */
+        pass_opts.reproject = NULL;
+        while(pass.samples < max_samples)
+        {
+            pass_opts.seed = opts->seed + pass.samples;
+            render_scene(pool, &frame, scene, view, &pass_opts);
+
+            float n = ++pass.samples;
+            long change = 0;
+            for(int y = 0; y < h; ++y)
+            {
+                float *acc = fb_row(&sum, y);
+                fb_read_row(&frame, 0, y, w, src);
+                fb_read_row(fb, 0, y, w, row);
+                for(int x = 0; x < w; ++x, acc += 4)
+                {
+                    acc[0] += src[x].r;
+                    acc[1] += src[x].g;
+                    acc[2] += src[x].b;
+                    struct rgb_t avg = { acc[0] / n + .5f, acc[1] / n + .5f, acc[2] / n + .5f };
+                    change += ABS(avg.r - row[x].r) + ABS(avg.g - row[x].g) + ABS(avg.b - row[x].b);
+                    row[x] = avg;
+                }
+                fb_write_row(fb, 0, y, row, w);
+            }
+            pass.change = (scalar)change / ((size_t)w * h * 3);
+
+            if(!pass_done(&pass, data))
+                break;
+            pass.pass++;
+            /* the first full pass is measured against a preview */
+            if(n > 1 && pass.change < threshold)
+                break;
+        }
+        fb_free(&frame);
+        fb_free(&sum);
+    }
+    free(row);
+    free(src);
+    return pass.samples;
+}
+
+void render_worker_stats(const struct render_pool_t *pool, int worker, struct render_stats_t *stats)
+{
+    assert(worker >= 0 && worker < pool->n_threads);
+    *stats = pool->info[worker].stats;
+}
+
+void render_stats(const struct render_pool_t *pool, struct render_stats_t *total)
+{
+    memset(total, 0, sizeof(*total));
+    for(int i = 0; i < pool->n_threads; ++i)
+    {
+        const struct render_stats_t *stats = &pool->info[i].stats;
+        total->primary += stats->primary;
+        total->shadow += stats->shadow;
+        total->reflections += stats->reflections;
+        total->supersampled += stats->supersampled;
+        total->reused += stats->reused;
+        for(int s = 0; s < N_STAGES; ++s)
+        {
+            total->rays[s] += stats->rays[s];
+            total->secs[s] += stats->secs[s];
+        }
+        add_counters(&total->counters, &stats->counters);
+        for(int d = 0; d <= MAX_BOUNCES; ++d)
+            total->depth[d] += stats->depth[d];
+        total->busy += stats->busy;
+        total->idle += stats->idle;
+    }
+}
+
+/* the average number of reflections per pixel, then in wavefront mode
+ * each stage's throughput; stage times are thread time, so rates are
+ * per thread. with -DCOUNTERS, also the hot-path counts, the spread of
+ * path depths and how busy each worker was */
+void print_render_stats(const struct render_pool_t *pool)
+{
+    struct render_stats_t total;
+    render_stats(pool, &total);
+
+    printf("depth      %9.3f bounces/pixel (%ld reflections)\n",
+           (double)total.reflections / total.primary, total.reflections);
+    if(total.reused)
+        printf("reprojected %8ld pixels kept (%.1f%%)\n",
+               total.reused, 100. * total.reused / total.primary);
+    if(total.supersampled)
+        printf("antialias  %9ld pixels supersampled (%.1f%%)\n",
+               total.supersampled, 100. * total.supersampled / total.primary);
+    for(int s = 0; s < N_STAGES; ++s)
+    {
+        if(!total.rays[s])
+            continue;
+        printf("%-10s %9ld rays %9.3f ms %9.2f Mrays/s\n", stage_names[s],
+               total.rays[s], total.secs[s] * 1e3, total.rays[s] / total.secs[s] * 1e-6);
+    }
+
+#ifdef COUNTERS
+    const struct counters_t *c = &total.counters;
+    printf("queries    %9ld nearest %9ld occlusion (%ld occluded)\n", c->nearest, c->occlusion, c->occluded);
+    printf("tests      %9ld boxes %9ld primitives\n", c->box_tests, c->prim_tests);
+    printf("packets    %9ld queries %9ld boxes %9ld primitives\n",
+           c->packets, c->packet_box_tests, c->packet_prim_tests);
+    for(int d = 0; d <= MAX_BOUNCES; ++d)
+        if(total.depth[d])
+            printf("paths      %9ld with %d reflections\n", total.depth[d], d);
+    for(int i = 0; i < pool->n_threads; ++i)
+    {
+        const struct render_stats_t *stats = &pool->info[i].stats;
+        printf("worker %-3d %9.3f ms busy %9.3f ms idle\n", i, stats->busy * 1e3, stats->idle * 1e3);
+    }
+#endif
+}
@@ -0,0 +1,127 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdbool.h>
+
+#include "camera.h"
+#include "counters.h"
+#include "framebuffer.h"
+#include "scene.h"
+
+/* deepest reflection chain any render mode follows */
+#define MAX_BOUNCES 50
+
+struct reproject_t;
+
+/* how to render a frame */
+struct render_opts_t {
+    int bounces;    /* at most MAX_BOUNCES */
+    int packet;     /* SIMD width for primary rays, or 0 for one at a time */
+    bool wavefront; /* breadth-first through per-stage ray queues */
+    /* the most, in 8-bit steps, a camera ray can change its pixel;
+     * reflections that would add less than a step are dropped, and
+     * INFINITY follows every bounce */
+    scalar weight;
+    /* 0 shades every hit with every light, except for lights so far
+     * off that all of them together could move it by less than
+     * light_cutoff 8-bit steps (weighted as above, so INFINITY keeps
+     * them all). otherwise each hit shades with this many lights,
+     * picked at random in proportion to what they are likely to add and
+     * scaled so that the expected sum is the true one; the cost then
+     * stays flat however many lights there are, at the price of noise */
+    int light_samples;
+    scalar light_cutoff;
+    unsigned seed;  /* varies the lights sampled; passes differ only in it */
+    /* above 1, pixels on edges are redrawn as the average of aa x aa
+     * rays; an edge is where neighbouring pixels see different objects
+     * or differ by more than aa_contrast 8-bit steps in a channel */
+    int aa;
+    int aa_contrast;
+    /* NULL, or where to keep each frame's primary hits so the next can
+     * reuse them: a pixel whose hit lands on the same spot of the same
+     * diffuse object it did last frame keeps its colour, and only the
+     * rest are shaded, along with a rotating sixteenth of all pixels so
+     * errors don't build up */
+    struct reproject_t *reproject;
+    bool progress;  /* print each finished tile */
+};
+
+enum { STAGE_GENERATE, STAGE_INTERSECT, STAGE_SHADE, STAGE_SHADOW, STAGE_SORT, N_STAGES };
+
+/* counters for one frame: rays traced by kind in any mode, and in
+ * wavefront mode the rays handled and thread time spent per stage */
+struct render_stats_t {
+    long primary, shadow, reflections;
+    long supersampled; /* pixels */
+    long reused;       /* pixels kept from the last frame */
+    long rays[N_STAGES];
+    double secs[N_STAGES];
+
+    /* the rest stays zero unless built with -DCOUNTERS */
+    struct counters_t counters;
+    long depth[MAX_BOUNCES + 1]; /* camera paths by reflections followed */
+    double busy, idle;           /* seconds spent on tiles and waiting */
+};
+
+struct render_pool_t;
+
+/* number of online CPUs, at least 1 */
+int detect_threads(void);
+
+/* n_threads <= 0 uses one thread per CPU */
+struct render_pool_t *create_pool(int n_threads);
+void destroy_pool(struct render_pool_t *pool);
+int pool_threads(const struct render_pool_t *pool);
+
+/* renders one frame at the view's resolution into fb, using every
+ * thread in the pool; blocks until it is done */
+void render_scene(struct render_pool_t *pool, const struct framebuffer_t *fb,
+                  const struct scene_t *scene,
+                  const struct camera_view_t *view, const struct render_opts_t *opts);
+
+/* starts rendering rows [y0, y1) of the frame into fb, which needs to
+ * hold only those rows, and returns at once; the caller can then write out the
+ * band before it while this one renders. a band starts once the one
+ * before it is done, and render_wait() blocks until the last one is.
+ * scene and view are read until then, and the stats start over with
+ * each band at row 0 */
+void render_rows(struct render_pool_t *pool, const struct framebuffer_t *fb,
+                 const struct scene_t *scene, const struct camera_view_t *view,
+                 int y0, int y1, const struct render_opts_t *opts);
+void render_wait(struct render_pool_t *pool);
+
+/* what render_progressive() has done so far */
+struct render_pass_t {
+    int pass;      /* from 0 */
+    int step;      /* pixels drawn as step x step blocks, 1 once at full size */
+    int samples;   /* full-size passes averaged so far */
+    scalar change; /* mean change per channel, in 8-bit steps, from the
+                    * last pass; 0 when one full pass is all there is */
+};
+
+/* renders the frame in passes, each a refinement of the one before: if
+ * previews is set a couple of blocky previews from a fraction of the
+ * pixels, then full size passes with different seeds averaged
+ * together. without light sampling one full pass is exact and is the
+ * last; with it, passes go on until one changes the image by less than
+ * threshold (see render_pass_t.change) or max_samples have been
+ * averaged. pass_done gets fb after every pass and can return false to
+ * stop there. returns the number of full size passes averaged, 0 if it
+ * stopped before one */
+int render_progressive(struct render_pool_t *pool, const struct framebuffer_t *fb,
+                       const struct scene_t *scene,
+                       const struct camera_view_t *view, const struct render_opts_t *opts,
+                       int max_samples, scalar threshold, bool previews,
+                       bool (*pass_done)(const struct render_pass_t *pass, void *data), void *data);
+
+struct reproject_t *reproject_create(void);
+/* forgets the last frame, for when something other than the camera changes */
+void reproject_reset(struct reproject_t *cache);
+void reproject_free(struct reproject_t *cache);
+
+/* counters for the last frame, for one worker or summed over all of them */
+void render_worker_stats(const struct render_pool_t *pool, int worker, struct render_stats_t *stats);
+void render_stats(const struct render_pool_t *pool, struct render_stats_t *total);
+void print_render_stats(const struct render_pool_t *pool);
+
+#endif
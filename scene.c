@@ -0,0 +1,1240 @@
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "counters.h"
+#include "scene.h"
+
+/* no fused multiply-adds even with -march flags that allow them, so
+ * these kernels round exactly like the SIMD ones in packet.c */
+#pragma GCC optimize("fp-contract=off")
+
+#ifdef COUNTERS
+__thread struct counters_t counters;
+#endif
+
+/* max objects per BVH leaf */
+#define BVH_LEAF_SIZE 4
+
+static void aabb_empty(struct aabb_t *box)
+{
+    for(int a = 0; a < 3; ++a)
+    {
+        box->min[a] = INFINITY;
+        box->max[a] = -INFINITY;
+    }
+}
+
+static void aabb_add_point(struct aabb_t *box, vec3 pt)
+{
+    scalar p[3] = { pt.x, pt.y, pt.z };
+    for(int a = 0; a < 3; ++a)
+    {
+        box->min[a] = MIN(box->min[a], p[a]);
+        box->max[a] = MAX(box->max[a], p[a]);
+    }
+}
+
+static void aabb_add_box(struct aabb_t *box, const struct aabb_t *other)
+{
+    for(int a = 0; a < 3; ++a)
+    {
+        box->min[a] = MIN(box->min[a], other->min[a]);
+        box->max[a] = MAX(box->max[a], other->max[a]);
+    }
+}
+
+/* pad slightly so rounding in the slab test can never cull a hit the
+ * exact intersection routine would report (flat triangles have
+ * zero-width boxes) */
+static void aabb_pad(struct aabb_t *box)
+{
+    for(int a = 0; a < 3; ++a)
+    {
+        box->min[a] -= 1e-4 * (1 + ABS(box->min[a]));
+        box->max[a] += 1e-4 * (1 + ABS(box->max[a]));
+    }
+}
+
+/* returns false for objects with no finite bounds (planes) */
+static bool object_bounds(const struct object_t *obj, struct aabb_t *box)
+{
+    aabb_empty(box);
+    switch(obj->type)
+    {
+    case SPHERE:
+    {
+        scalar r = ABS(obj->sphere.radius);
+        aabb_add_point(box, vec3_sub(obj->sphere.center, vec3_make(r, r, r)));
+        aabb_add_point(box, vec3_add(obj->sphere.center, vec3_make(r, r, r)));
+        break;
+    }
+    case TRI:
+        for(int i = 0; i < 3; ++i)
+            aabb_add_point(box, obj->tri.points[i]);
+        break;
+    case PLANE:
+    default:
+        return false;
+    }
+    aabb_pad(box);
+    return true;
+}
+
+static bool tri_degenerate(vec3 p0, vec3 p1, vec3 p2)
+{
+    vec3 u = vec3_sub(p1, p0), v = vec3_sub(p2, p0);
+    return vec3_abs(vec3_cross(u, v)) == 0;
+}
+
+int scene_mesh(const struct scene_t *scene, int handle)
+{
+    /* the last mesh whose first handle is at or before this one */
+    int lo = 0, hi = scene->n_meshes - 1;
+    while(lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if(scene->mesh_refs[mid].first_handle <= handle)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+int scene_instance(const struct scene_t *scene, int handle)
+{
+    int lo = 0, hi = scene->n_instances - 1;
+    while(lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if(scene->instance_refs[mid].first_handle <= handle)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/* a mesh triangle's vertex indices, within its mesh *m */
+static const int *mesh_tri(const struct scene_t *scene, int handle, int *m)
+{
+    *m = scene_mesh(scene, handle);
+    return scene->meshes[*m].indices + 3 * (handle - scene->mesh_refs[*m].first_handle);
+}
+
+static int handle_type(const struct scene_t *scene, int handle)
+{
+    return handle < scene->n_objects ? scene->objects[handle].type : TRI;
+}
+
+static scalar *new_scalars(int n)
+{
+    return malloc(sizeof(scalar) * MAX(n, 1));
+}
+
+static int *new_ints(int n)
+{
+    return malloc(sizeof(int) * MAX(n, 1));
+}
+
+static void alloc_arrays(struct scene_t *scene, int n_spheres, int n_planes, int n_tris, int n_verts)
+{
+    struct sphere_array_t *s = &scene->spheres;
+    s->x = new_scalars(n_spheres);
+    s->y = new_scalars(n_spheres);
+    s->z = new_scalars(n_spheres);
+    s->r2 = new_scalars(n_spheres);
+    s->id = new_ints(n_spheres);
+    s->n = 0;
+
+    struct plane_array_t *p = &scene->planes;
+    p->px = new_scalars(n_planes);
+    p->py = new_scalars(n_planes);
+    p->pz = new_scalars(n_planes);
+    p->nx = new_scalars(n_planes);
+    p->ny = new_scalars(n_planes);
+    p->nz = new_scalars(n_planes);
+    p->id = new_ints(n_planes);
+    p->n = 0;
+
+    struct tri_array_t *t = &scene->tris;
+    t->x = new_scalars(n_verts);
+    t->y = new_scalars(n_verts);
+    t->z = new_scalars(n_verts);
+    t->n_verts = 0;
+    t->i0 = new_ints(n_tris);
+    t->i1 = new_ints(n_tris);
+    t->i2 = new_ints(n_tris);
+    t->rec = malloc(sizeof(struct tri_record_t) * MAX(n_tris, 1));
+    t->id = new_ints(n_tris);
+    t->n = 0;
+}
+
+static void free_arrays(struct scene_t *scene)
+{
+    struct sphere_array_t *s = &scene->spheres;
+    free(s->x);
+    free(s->y);
+    free(s->z);
+    free(s->r2);
+    free(s->id);
+
+    struct plane_array_t *p = &scene->planes;
+    free(p->px);
+    free(p->py);
+    free(p->pz);
+    free(p->nx);
+    free(p->ny);
+    free(p->nz);
+    free(p->id);
+
+    struct tri_array_t *t = &scene->tris;
+    free(t->x);
+    free(t->y);
+    free(t->z);
+    free(t->i0);
+    free(t->i1);
+    free(t->i2);
+    free(t->rec);
+    free(t->id);
+}
+
+static int add_vertex(struct tri_array_t *t, vec3 pt)
+{
+    int v = t->n_verts++;
+    t->x[v] = pt.x;
+    t->y[v] = pt.y;
+    t->z[v] = pt.z;
+    return v;
+}
+
+/* rebuilds a triangle's record from its vertices */
+static void set_tri_record(struct tri_array_t *t, int i)
+{
+    vec3 p0 = tri_vertex(t, t->i0[i]),
+        e1 = vec3_sub(tri_vertex(t, t->i1[i]), p0),
+        e2 = vec3_sub(tri_vertex(t, t->i2[i]), p0);
+    struct tri_record_t *rec = t->rec + i;
+    rec->v0[0] = p0.x;
+    rec->v0[1] = p0.y;
+    rec->v0[2] = p0.z;
+    rec->e1[0] = e1.x;
+    rec->e1[1] = e1.y;
+    rec->e1[2] = e1.z;
+    rec->e2[0] = e2.x;
+    rec->e2[1] = e2.y;
+    rec->e2[2] = e2.z;
+}
+
+static int add_tri(struct tri_array_t *t, int i0, int i1, int i2, int id)
+{
+    int slot = t->n++;
+    t->i0[slot] = i0;
+    t->i1[slot] = i1;
+    t->i2[slot] = i2;
+    t->id[slot] = id;
+    set_tri_record(t, slot);
+    return slot;
+}
+
+/* append an object to the array for its type and record where it went */
+static void emit_object(struct scene_t *scene, int id)
+{
+    const struct object_t *obj = scene->objects + id;
+    int slot = -1;
+    switch(obj->type)
+    {
+    case SPHERE:
+    {
+        struct sphere_array_t *s = &scene->spheres;
+        slot = s->n++;
+        s->x[slot] = obj->sphere.center.x;
+        s->y[slot] = obj->sphere.center.y;
+        s->z[slot] = obj->sphere.center.z;
+        s->r2[slot] = SQR(obj->sphere.radius);
+        s->id[slot] = id;
+        break;
+    }
+    case PLANE:
+    {
+        struct plane_array_t *p = &scene->planes;
+        slot = p->n++;
+        p->px[slot] = obj->plane.point.x;
+        p->py[slot] = obj->plane.point.y;
+        p->pz[slot] = obj->plane.point.z;
+        p->nx[slot] = obj->plane.normal.x;
+        p->ny[slot] = obj->plane.normal.y;
+        p->nz[slot] = obj->plane.normal.z;
+        p->id[slot] = id;
+        break;
+    }
+    case TRI:
+    {
+        /* a lone triangle gets vertices of its own */
+        struct tri_array_t *t = &scene->tris;
+        int v = add_vertex(t, obj->tri.points[0]);
+        add_vertex(t, obj->tri.points[1]);
+        add_vertex(t, obj->tri.points[2]);
+        slot = add_tri(t, v, v + 1, v + 2, id);
+        break;
+    }
+    default:
+        assert(false);
+    }
+    scene->prims[id].type = obj->type;
+    scene->prims[id].slot = slot;
+}
+
+/* a mesh triangle's vertices were copied in up front, so only its
+ * indices go in */
+static void emit_handle(struct scene_t *scene, int handle)
+{
+    if(handle < scene->n_objects)
+    {
+        emit_object(scene, handle);
+        return;
+    }
+    int m;
+    const int *idx = mesh_tri(scene, handle, &m);
+    int base = scene->mesh_refs[m].first_vert;
+    scene->mesh_slots[handle - scene->n_objects] =
+        add_tri(&scene->tris, base + idx[0], base + idx[1], base + idx[2], handle);
+}
+
+/* { o, d } form a ray */
+/* point of intersection is *t * d units away */
+inline bool sphere_intersects(const struct sphere_array_t *s, int i, vec3 o, vec3 d, scalar *t)
+{
+    COUNT(prim_tests);
+    vec3 oc = vec3_sub(o, vec3_make(s->x[i], s->y[i], s->z[i]));
+    scalar a = vec3_dot(d, d),
+        b = 2 * vec3_dot(oc, d),
+        c = vec3_dot(oc, oc) - s->r2[i];
+    scalar disc = b*b - 4*a*c;
+    if(disc < 0)
+        return false;
+    /* single precision throughout, so the SIMD kernels can match it exactly */
+    scalar sq = sqrtf(disc);
+    scalar t1 = (-b - sq) / (2*a), t2 = (-b + sq) / (2*a);
+    /* both are negative */
+    if(t1 < 0 && t2 < 0)
+        return false;
+    /* one is negative: ray starts inside the sphere */
+    if(t1 * t2 < 0)
+    {
+        *t = MAX(t1, t2);
+        return true;
+    }
+    *t = MIN(t1, t2);
+    return true;
+}
+
+inline bool plane_intersects(const struct plane_array_t *p, int i, vec3 o, vec3 d, scalar *t)
+{
+    COUNT(prim_tests);
+    vec3 normal = vec3_make(p->nx[i], p->ny[i], p->nz[i]);
+    scalar denom = vec3_dot(normal, d);
+    if(!denom)
+        return false;
+    scalar t1 = vec3_dot(normal, vec3_sub(vec3_make(p->px[i], p->py[i], p->pz[i]), o)) / denom;
+    if(t1 <= 0)
+        return false;
+    *t = t1;
+    return true;
+}
+
+/* Moller-Trumbore: solves for the distance and two barycentrics at
+ * once, with one divide and no hit point. degenerate triangles never
+ * make it into the array, but a ray in the triangle's plane still has
+ * det == 0 and is a miss */
+inline bool tri_intersects(const struct tri_array_t *tri, int i, vec3 o, vec3 d, scalar *t)
+{
+    COUNT(prim_tests);
+    const struct tri_record_t *rec = tri->rec + i;
+    vec3 e1 = vec3_make(rec->e1[0], rec->e1[1], rec->e1[2]),
+        e2 = vec3_make(rec->e2[0], rec->e2[1], rec->e2[2]);
+    vec3 p = vec3_cross(d, e2);
+    scalar det = vec3_dot(e1, p);
+    if(!det)
+        return false;
+    scalar inv_det = 1 / det;
+
+    vec3 s = vec3_sub(o, vec3_make(rec->v0[0], rec->v0[1], rec->v0[2]));
+    scalar u = vec3_dot(s, p) * inv_det;
+    if(u < 0 || u > 1)
+        return false;
+    vec3 q = vec3_cross(s, e1);
+    scalar v = vec3_dot(d, q) * inv_det;
+    if(v < 0 || u + v > 1)
+        return false;
+
+    scalar t1 = vec3_dot(e2, q) * inv_det;
+    /* behind camera */
+    if(t1 <= 0)
+        return false;
+    *t = t1;
+    return true;
+}
+
+/* the face normal, on the side the old precomputed triangles used */
+static vec3 tri_normal(vec3 p0, vec3 p1, vec3 p2)
+{
+    return vec3_negate(vec3_cross(vec3_sub(p1, p0), vec3_sub(p2, p0)));
+}
+
+static vec3 xform_point(const scalar m[3][4], vec3 p)
+{
+    return vec3_make(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                     m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                     m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+}
+
+static vec3 xform_dir(const scalar m[3][4], vec3 d)
+{
+    return vec3_make(m[0][0] * d.x + m[0][1] * d.y + m[0][2] * d.z,
+                     m[1][0] * d.x + m[1][1] * d.y + m[1][2] * d.z,
+                     m[2][0] * d.x + m[2][1] * d.y + m[2][2] * d.z);
+}
+
+vec3 normal_at_point(const struct scene_t *scene, int handle, vec3 pt)
+{
+    const struct tri_array_t *t = &scene->tris;
+    if(handle >= scene->n_objects && scene_is_instance(scene, handle))
+    {
+        /* the cofactors take the object space normal to the cross
+         * product of the moved edges, so mirrored copies face the
+         * same way a moved copy of the mesh would */
+        const struct instance_ref_t *ref = scene->instance_refs + scene_instance(scene, handle);
+        int i = scene->mesh_slots[handle - ref->handle_offset - scene->n_objects];
+        vec3 n = tri_normal(tri_vertex(t, t->i0[i]), tri_vertex(t, t->i1[i]), tri_vertex(t, t->i2[i]));
+        const scalar (*c)[3] = ref->normal;
+        return vec3_make(c[0][0] * n.x + c[0][1] * n.y + c[0][2] * n.z,
+                         c[1][0] * n.x + c[1][1] * n.y + c[1][2] * n.z,
+                         c[2][0] * n.x + c[2][1] * n.y + c[2][2] * n.z);
+    }
+    if(handle >= scene->n_objects)
+    {
+        int i = scene->mesh_slots[handle - scene->n_objects];
+        return tri_normal(tri_vertex(t, t->i0[i]), tri_vertex(t, t->i1[i]), tri_vertex(t, t->i2[i]));
+    }
+
+    int i = scene->prims[handle].slot;
+    switch(scene->prims[handle].type)
+    {
+    case SPHERE:
+        return vec3_sub(pt, vec3_make(scene->spheres.x[i], scene->spheres.y[i], scene->spheres.z[i]));
+    case PLANE:
+        return vec3_make(scene->planes.nx[i], scene->planes.ny[i], scene->planes.nz[i]);
+    case TRI:
+        return tri_normal(tri_vertex(t, t->i0[i]), tri_vertex(t, t->i1[i]), tri_vertex(t, t->i2[i]));
+    default:
+        assert(false);
+    }
+    return vec3_make(0, 0, 0);
+}
+
+struct bvh_item_t {
+    int index;
+    struct aabb_t bounds;
+    scalar centroid[3];
+};
+
+struct bvh_builder_t {
+    struct scene_t *scene;
+    struct bvh_item_t *items;
+};
+
+/* quickselect: reorder items so that items[k] has the k-th smallest
+ * centroid along axis, with nothing larger before it or smaller after */
+static void select_items(struct bvh_item_t *items, int n, int axis, int k)
+{
+    int lo = 0, hi = n - 1;
+    while(lo < hi)
+    {
+        scalar pivot = items[(lo + hi) / 2].centroid[axis];
+        int i = lo, j = hi;
+        while(i <= j)
+        {
+            while(items[i].centroid[axis] < pivot)
+                ++i;
+            while(items[j].centroid[axis] > pivot)
+                --j;
+            if(i <= j)
+            {
+                struct bvh_item_t tmp = items[i];
+                items[i] = items[j];
+                items[j] = tmp;
+                ++i;
+                --j;
+            }
+        }
+        if(k <= j)
+            hi = j;
+        else if(k >= i)
+            lo = i;
+        else
+            break;
+    }
+}
+
+/* builds the subtree over items [first, first + n) and returns its node
+ * index; leaves are made in depth-first order, so each one appends its
+ * geometry to the per-type arrays as a contiguous run */
+static int build_node(struct bvh_builder_t *b, int first, int n)
+{
+    struct scene_t *scene = b->scene;
+    int idx = scene->n_bvh_nodes++;
+    struct bvh_node_t *node = scene->bvh + idx;
+
+    struct aabb_t centroids;
+    aabb_empty(&node->bounds);
+    aabb_empty(&centroids);
+    for(int i = first; i < first + n; ++i)
+    {
+        aabb_add_box(&node->bounds, &b->items[i].bounds);
+        for(int a = 0; a < 3; ++a)
+        {
+            centroids.min[a] = MIN(centroids.min[a], b->items[i].centroid[a]);
+            centroids.max[a] = MAX(centroids.max[a], b->items[i].centroid[a]);
+        }
+    }
+
+    int axis = 0;
+    for(int a = 1; a < 3; ++a)
+        if(centroids.max[a] - centroids.min[a] > centroids.max[axis] - centroids.min[axis])
+            axis = a;
+
+    /* all centroids coincide: splitting won't separate anything */
+    if(n <= BVH_LEAF_SIZE || centroids.max[axis] <= centroids.min[axis])
+    {
+        node->offset = scene->spheres.n;
+        node->first_tri = scene->tris.n;
+        for(int i = first; i < first + n; ++i)
+            if(handle_type(scene, b->items[i].index) == SPHERE)
+                emit_handle(scene, b->items[i].index);
+        for(int i = first; i < first + n; ++i)
+            if(handle_type(scene, b->items[i].index) == TRI)
+                emit_handle(scene, b->items[i].index);
+        node->n_spheres = scene->spheres.n - node->offset;
+        node->n_tris = scene->tris.n - node->first_tri;
+        return idx;
+    }
+
+    int mid = n / 2;
+    select_items(b->items + first, n, axis, mid);
+
+    node->first_tri = 0;
+    node->n_spheres = 0;
+    node->n_tris = 0;
+    build_node(b, first, mid);
+    /* the node array never grows, so node is still valid */
+    node->offset = build_node(b, first + mid, n - mid);
+    return idx;
+}
+
+/* one light per leaf; a node's bounds and intensity cover every
+ * light under it */
+static int build_light_node(struct scene_t *scene, struct bvh_item_t *items, int n)
+{
+    int idx = scene->n_light_nodes++;
+    struct light_node_t *node = scene->light_bvh + idx;
+    aabb_empty(&node->bounds);
+    node->intensity = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        aabb_add_box(&node->bounds, &items[i].bounds);
+        node->intensity += scene->lights[items[i].index].intensity;
+    }
+    if(n == 1)
+    {
+        node->offset = items[0].index;
+        node->leaf = 1;
+        return idx;
+    }
+
+    int axis = 0;
+    for(int a = 1; a < 3; ++a)
+        if(node->bounds.max[a] - node->bounds.min[a] > node->bounds.max[axis] - node->bounds.min[axis])
+            axis = a;
+
+    int mid = n / 2;
+    select_items(items, n, axis, mid);
+    node->leaf = 0;
+    build_light_node(scene, items, mid);
+    node->offset = build_light_node(scene, items + mid, n - mid);
+    return idx;
+}
+
+static void build_light_bvh(struct scene_t *scene)
+{
+    scene->light_bvh = malloc(sizeof(struct light_node_t) * MAX(2 * (int)scene->n_lights - 1, 1));
+    scene->n_light_nodes = 0;
+    if(!scene->n_lights)
+        return;
+
+    struct bvh_item_t *items = malloc(sizeof(struct bvh_item_t) * scene->n_lights);
+    for(int i = 0; i < scene->n_lights; ++i)
+    {
+        vec3 pos = scene->lights[i].position;
+        items[i].index = i;
+        aabb_empty(&items[i].bounds);
+        aabb_add_point(&items[i].bounds, pos);
+        items[i].centroid[0] = pos.x;
+        items[i].centroid[1] = pos.y;
+        items[i].centroid[2] = pos.z;
+    }
+    build_light_node(scene, items, scene->n_lights);
+    free(items);
+}
+
+/* one instance per leaf, like the lights' tree */
+static int build_instance_node(struct scene_t *scene, struct bvh_item_t *items, int n)
+{
+    int idx = scene->n_instance_nodes++;
+    struct instance_node_t *node = scene->instance_bvh + idx;
+    aabb_empty(&node->bounds);
+    for(int i = 0; i < n; ++i)
+        aabb_add_box(&node->bounds, &items[i].bounds);
+    if(n == 1)
+    {
+        node->offset = items[0].index;
+        node->leaf = 1;
+        return idx;
+    }
+
+    int axis = 0;
+    for(int a = 1; a < 3; ++a)
+        if(node->bounds.max[a] - node->bounds.min[a] > node->bounds.max[axis] - node->bounds.min[axis])
+            axis = a;
+
+    int mid = n / 2;
+    select_items(items, n, axis, mid);
+    node->leaf = 0;
+    build_instance_node(scene, items, mid);
+    node->offset = build_instance_node(scene, items + mid, n - mid);
+    return idx;
+}
+
+void instance_transform(struct instance_t *inst, vec3 pos, vec3 angles, scalar scale)
+{
+    double cx = cos(angles.x), sx = sin(angles.x),
+        cy = cos(angles.y), sy = sin(angles.y),
+        cz = cos(angles.z), sz = sin(angles.z);
+    /* rz * ry * rx */
+    double r[3][3] = {
+        { cz * cy, cz * sy * sx - sz * cx, cz * sy * cx + sz * sx },
+        { sz * cy, sz * sy * sx + cz * cx, sz * sy * cx - cz * sx },
+        { -sy,     cy * sx,                cy * cx },
+    };
+    scalar p[3] = { pos.x, pos.y, pos.z };
+    for(int i = 0; i < 3; ++i)
+    {
+        for(int j = 0; j < 3; ++j)
+            inst->xform[i][j] = r[i][j] * scale;
+        inst->xform[i][3] = p[i];
+    }
+}
+
+/* the inverse of an affine transform, and the cofactors of its linear
+ * part for normals; in double, since a float inverse of a large
+ * transform loses more than the intersection tests can spare */
+static void invert_xform(const scalar m[3][4], scalar inv[3][4], scalar cof[3][3])
+{
+    double c[3][3];
+    for(int i = 0; i < 3; ++i)
+        for(int j = 0; j < 3; ++j)
+        {
+            int i1 = (i + 1) % 3, i2 = (i + 2) % 3, j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            c[i][j] = (double)m[i1][j1] * m[i2][j2] - (double)m[i1][j2] * m[i2][j1];
+            cof[i][j] = c[i][j];
+        }
+    double det = m[0][0] * c[0][0] + m[0][1] * c[0][1] + m[0][2] * c[0][2];
+    assert(det != 0);
+    for(int i = 0; i < 3; ++i)
+    {
+        double t = 0;
+        for(int j = 0; j < 3; ++j)
+        {
+            inv[i][j] = c[j][i] / det;
+            t -= c[j][i] / det * m[j][3];
+        }
+        inv[i][3] = t;
+    }
+}
+
+static void set_instance_xform(struct instance_ref_t *ref, const scalar xform[3][4])
+{
+    memcpy(ref->to_world, xform, sizeof(ref->to_world));
+    invert_xform(xform, ref->to_object, ref->normal);
+}
+
+/* the corners of the mesh's box, moved */
+static void instance_bounds(const struct scene_t *scene, const struct instance_ref_t *ref, struct aabb_t *out)
+{
+    const struct aabb_t *box = &scene->bvh[ref->root].bounds;
+    aabb_empty(out);
+    for(int c = 0; c < 8; ++c)
+    {
+        vec3 p = vec3_make(box->min[0], box->min[1], box->min[2]);
+        if(c & 1)
+            p.x = box->max[0];
+        if(c & 2)
+            p.y = box->max[1];
+        if(c & 4)
+            p.z = box->max[2];
+        aabb_add_point(out, xform_point(ref->to_world, p));
+    }
+    aabb_pad(out);
+}
+
+void scene_move_instance(struct scene_t *scene, int k, const scalar xform[3][4])
+{
+    struct instance_ref_t *ref = scene->instance_refs + k;
+    set_instance_xform(ref, xform);
+    ref->moved = 1;
+}
+
+void refit_instances(struct scene_t *scene)
+{
+    /* children come after their parents, so going backwards sees both
+     * of a node's children before it */
+    int n = scene->n_instance_nodes;
+    bool *changed = malloc(MAX(n, 1));
+    for(int i = n - 1; i >= 0; --i)
+    {
+        struct instance_node_t *node = scene->instance_bvh + i;
+        if(node->leaf)
+        {
+            struct instance_ref_t *ref = scene->instance_refs + node->offset;
+            changed[i] = ref->moved;
+            if(ref->moved)
+                instance_bounds(scene, ref, &node->bounds);
+            ref->moved = 0;
+        }
+        else
+        {
+            changed[i] = changed[i + 1] || changed[node->offset];
+            if(changed[i])
+            {
+                node->bounds = scene->instance_bvh[i + 1].bounds;
+                aabb_add_box(&node->bounds, &scene->instance_bvh[node->offset].bounds);
+            }
+        }
+    }
+    free(changed);
+}
+
+/* bounding items for a mesh's triangles with any area, appended at
+ * items; returns how many */
+static int mesh_items(struct scene_t *scene, int m, struct bvh_item_t *items)
+{
+    const struct mesh_t *mesh = scene->meshes + m;
+    int n = 0;
+    for(int i = 0; i < mesh->n_tris; ++i)
+    {
+        const int *idx = mesh->indices + 3 * i;
+        vec3 p0 = mesh->verts[idx[0]], p1 = mesh->verts[idx[1]], p2 = mesh->verts[idx[2]];
+        scene->mesh_slots[scene->mesh_refs[m].first_handle - scene->n_objects + i] = -1;
+        if(tri_degenerate(p0, p1, p2))
+            continue;
+
+        struct bvh_item_t *item = items + n++;
+        item->index = scene->mesh_refs[m].first_handle + i;
+        aabb_empty(&item->bounds);
+        aabb_add_point(&item->bounds, p0);
+        aabb_add_point(&item->bounds, p1);
+        aabb_add_point(&item->bounds, p2);
+        aabb_pad(&item->bounds);
+        for(int a = 0; a < 3; ++a)
+            item->centroid[a] = .5 * (item->bounds.min[a] + item->bounds.max[a]);
+    }
+    return n;
+}
+
+/* each instanced mesh gets a tree of its own after the world's, and
+ * the instances a tree over them whose leaves are those trees' roots
+ * moved into place */
+static void build_instances(struct scene_t *scene, struct bvh_builder_t *b, const bool *instanced)
+{
+    int *roots = new_ints(scene->n_meshes);
+    for(int m = 0; m < scene->n_meshes; ++m)
+    {
+        roots[m] = -1;
+        int n = instanced[m] ? mesh_items(scene, m, b->items) : 0;
+        if(n)
+            roots[m] = build_node(b, 0, n);
+    }
+
+    scene->instance_refs = malloc(sizeof(struct instance_ref_t) * MAX(scene->n_instances, 1));
+    scene->instance_bvh = malloc(sizeof(struct instance_node_t) * MAX(2 * (int)scene->n_instances - 1, 1));
+    scene->n_instance_nodes = 0;
+    struct bvh_item_t *items = malloc(sizeof(struct bvh_item_t) * MAX(scene->n_instances, 1));
+    int n_items = 0;
+
+    long handle = scene->mesh_refs[scene->n_meshes].first_handle;
+    for(int k = 0; k < scene->n_instances; ++k)
+    {
+        const struct instance_t *inst = scene->instances + k;
+        struct instance_ref_t *ref = scene->instance_refs + k;
+        struct material_t *mat = scene->materials + scene->n_objects + scene->n_meshes + k;
+        mat->color = inst->color;
+        mat->specularity = inst->specularity;
+
+        ref->first_handle = handle;
+        ref->handle_offset = handle - scene->mesh_refs[inst->mesh].first_handle;
+        ref->root = roots[inst->mesh];
+        ref->moved = 0;
+        handle += scene->meshes[inst->mesh].n_tris;
+        assert(handle <= INT_MAX);
+        set_instance_xform(ref, inst->xform);
+        if(ref->root < 0)
+            continue;
+
+        struct bvh_item_t *item = items + n_items++;
+        item->index = k;
+        instance_bounds(scene, ref, &item->bounds);
+        for(int a = 0; a < 3; ++a)
+            item->centroid[a] = .5 * (item->bounds.min[a] + item->bounds.max[a]);
+    }
+    if(n_items)
+        build_instance_node(scene, items, n_items);
+    free(items);
+    free(roots);
+}
+
+/* splits the objects and meshes into the per-type arrays, with spheres
+ * and triangles ordered by BVH leaf */
+void preprocess_scene(struct scene_t *scene)
+{
+    int n_spheres = 0, n_planes = 0, n_tris = 0, n_verts = 0;
+    for(int i = 0; i < scene->n_objects; ++i)
+    {
+        switch(scene->objects[i].type)
+        {
+        case SPHERE:
+            ++n_spheres;
+            break;
+        case PLANE:
+            ++n_planes;
+            break;
+        case TRI:
+            ++n_tris;
+            n_verts += 3;
+            break;
+        }
+    }
+
+    /* mesh triangles are numbered after the objects, and the meshes'
+     * vertices come first in the vertex arrays, ahead of those the
+     * lone triangles add as the tree is built */
+    scene->mesh_refs = malloc(sizeof(struct mesh_ref_t) * (scene->n_meshes + 1));
+    int n_handles = scene->n_objects, n_mesh_verts = 0;
+    for(int m = 0; m <= scene->n_meshes; ++m)
+    {
+        scene->mesh_refs[m].first_handle = n_handles;
+        scene->mesh_refs[m].first_vert = n_mesh_verts;
+        if(m == scene->n_meshes)
+            break;
+        n_handles += scene->meshes[m].n_tris;
+        n_tris += scene->meshes[m].n_tris;
+        n_mesh_verts += scene->meshes[m].n_verts;
+    }
+    n_verts += n_mesh_verts;
+
+    alloc_arrays(scene, n_spheres, n_planes, n_tris, n_verts);
+    scene->materials = malloc(sizeof(struct material_t) *
+                              MAX(scene->n_objects + scene->n_meshes + scene->n_instances, 1));
+    scene->prims = malloc(sizeof(struct prim_ref_t) * MAX(scene->n_objects, 1));
+    scene->mesh_slots = new_ints(n_handles - scene->n_objects);
+    scene->cache = NULL;
+    scene->cache_size = 0;
+
+    struct bvh_item_t *items = malloc(sizeof(struct bvh_item_t) * MAX(n_handles, 1));
+    int n_items = 0;
+
+    for(int i = 0; i < scene->n_objects; ++i)
+    {
+        const struct object_t *obj = scene->objects + i;
+        scene->materials[i].color = obj->color;
+        scene->materials[i].specularity = obj->specularity;
+
+        /* a triangle with no area can never be hit, so drop it here */
+        if(obj->type == TRI && tri_degenerate(obj->tri.points[0], obj->tri.points[1], obj->tri.points[2]))
+        {
+            scene->prims[i].type = TRI;
+            scene->prims[i].slot = -1;
+            continue;
+        }
+
+        struct bvh_item_t *item = items + n_items;
+        if(!object_bounds(obj, &item->bounds))
+        {
+            emit_object(scene, i);
+            continue;
+        }
+        item->index = i;
+        for(int a = 0; a < 3; ++a)
+            item->centroid[a] = .5 * (item->bounds.min[a] + item->bounds.max[a]);
+        ++n_items;
+    }
+
+    bool *instanced = calloc(MAX(scene->n_meshes, 1), sizeof(bool));
+    for(int k = 0; k < scene->n_instances; ++k)
+    {
+        assert(scene->instances[k].mesh >= 0 && scene->instances[k].mesh < scene->n_meshes);
+        instanced[scene->instances[k].mesh] = true;
+    }
+    int n_instanced_tris = 0;
+    for(int m = 0; m < scene->n_meshes; ++m)
+        if(instanced[m])
+            n_instanced_tris += scene->meshes[m].n_tris;
+
+    for(int m = 0; m < scene->n_meshes; ++m)
+    {
+        const struct mesh_t *mesh = scene->meshes + m;
+        struct material_t *mat = scene->materials + scene->n_objects + m;
+        mat->color = mesh->color;
+        mat->specularity = mesh->specularity;
+
+        for(int v = 0; v < mesh->n_verts; ++v)
+            add_vertex(&scene->tris, mesh->verts[v]);
+
+        if(!instanced[m])
+            n_items += mesh_items(scene, m, items + n_items);
+    }
+
+    /* room for the world's tree and every instanced mesh's */
+    scene->bvh = malloc(sizeof(struct bvh_node_t) * MAX(2 * (n_items + n_instanced_tris), 1));
+    scene->n_bvh_nodes = 0;
+    struct bvh_builder_t b = { scene, items };
+    if(n_items)
+        build_node(&b, 0, n_items);
+    scene->n_world_nodes = scene->n_bvh_nodes;
+    build_instances(scene, &b, instanced);
+
+    free(instanced);
+    free(items);
+    build_light_bvh(scene);
+}
+
+void free_scene(struct scene_t *scene)
+{
+    if(scene->cache)
+    {
+        /* everything points into the mapping */
+        munmap(scene->cache, scene->cache_size);
+        memset(scene, 0, sizeof(*scene));
+        return;
+    }
+    free_arrays(scene);
+    free(scene->materials);
+    free(scene->prims);
+    free(scene->mesh_refs);
+    free(scene->mesh_slots);
+    free(scene->bvh);
+    free(scene->instance_refs);
+    free(scene->instance_bvh);
+    free(scene->light_bvh);
+    scene->materials = NULL;
+    scene->prims = NULL;
+    scene->mesh_refs = NULL;
+    scene->mesh_slots = NULL;
+    scene->bvh = NULL;
+    scene->n_bvh_nodes = 0;
+    scene->n_world_nodes = 0;
+    scene->instance_refs = NULL;
+    scene->instance_bvh = NULL;
+    scene->n_instance_nodes = 0;
+    scene->light_bvh = NULL;
+    scene->n_light_nodes = 0;
+}
+
+void free_mesh(struct mesh_t *mesh)
+{
+    free(mesh->verts);
+    free(mesh->indices);
+    mesh->verts = NULL;
+    mesh->indices = NULL;
+    mesh->n_verts = 0;
+    mesh->n_tris = 0;
+}
+
+/* slab test; on a hit *t_near is where the ray enters the box */
+static inline bool ray_hits_box(const struct aabb_t *box, const scalar *o, const scalar *inv_d,
+                                scalar t_max, scalar *t_near)
+{
+    COUNT(box_tests);
+    scalar t_min = 0;
+    for(int a = 0; a < 3; ++a)
+    {
+        scalar t0 = (box->min[a] - o[a]) * inv_d[a],
+            t1 = (box->max[a] - o[a]) * inv_d[a];
+        if(t0 > t1)
+        {
+            scalar tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        /* written so that a NaN (0 * inf) leaves the interval alone */
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if(t_min > t_max)
+            return false;
+    }
+    *t_near = t_min;
+    return true;
+}
+
+/* keeps the closest hit; ties go to the lowest handle, which is what a
+ * front-to-back scan of scene->objects would pick */
+static inline void keep_nearest(int id, scalar t, scalar *dist, int *best)
+{
+    if(*dist < 0 || t < *dist || (t == *dist && id < *best))
+    {
+        *dist = t;
+        *best = id;
+    }
+}
+
+/* only the instanced meshes' trees have a handle offset, and they
+ * hold nothing but triangles */
+static inline void leaf_nearest(const struct scene_t *scene, const struct bvh_node_t *node, int offset,
+                                vec3 orig, vec3 d, int avoid, scalar *dist, int *best)
+{
+    scalar t;
+    const struct sphere_array_t *s = &scene->spheres;
+    for(int i = node->offset; i < node->offset + node->n_spheres; ++i)
+        if(s->id[i] != avoid && sphere_intersects(s, i, orig, d, &t))
+            keep_nearest(s->id[i], t, dist, best);
+
+    const struct tri_array_t *tri = &scene->tris;
+    for(int i = node->first_tri; i < node->first_tri + node->n_tris; ++i)
+        if(tri->id[i] + offset != avoid && tri_intersects(tri, i, orig, d, &t))
+            keep_nearest(tri->id[i] + offset, t, dist, best);
+}
+
+/* nearest hit in the tree at scene->bvh[root], with its triangles'
+ * handles moved up by offset */
+static inline void bvh_nearest(const struct scene_t *scene, int root, int offset,
+                               vec3 orig, vec3 d, int avoid, scalar *dist, int *best)
+{
+    scalar o[3] = { orig.x, orig.y, orig.z };
+    scalar inv_d[3] = { 1 / d.x, 1 / d.y, 1 / d.z };
+    scalar t_near;
+
+    if(ray_hits_box(&scene->bvh[root].bounds, o, inv_d, *best < 0 ? INFINITY : *dist, &t_near))
+    {
+        int stack[BVH_STACK_SIZE], sp = 0;
+        int idx = root;
+
+        while(1)
+        {
+            const struct bvh_node_t *node = scene->bvh + idx;
+            if(bvh_is_leaf(node))
+            {
+                leaf_nearest(scene, node, offset, orig, d, avoid, dist, best);
+            }
+            else
+            {
+                /* visit the nearer child first and save the other for later */
+                scalar t_max = *best < 0 ? INFINITY : *dist;
+                int left = idx + 1, right = node->offset;
+                scalar t_left, t_right;
+                bool hit_left = ray_hits_box(&scene->bvh[left].bounds, o, inv_d, t_max, &t_left),
+                    hit_right = ray_hits_box(&scene->bvh[right].bounds, o, inv_d, t_max, &t_right);
+                if(hit_left && hit_right)
+                {
+                    if(t_right < t_left)
+                    {
+                        stack[sp++] = left;
+                        idx = right;
+                    }
+                    else
+                    {
+                        stack[sp++] = right;
+                        idx = left;
+                    }
+                    continue;
+                }
+                else if(hit_left)
+                {
+                    idx = left;
+                    continue;
+                }
+                else if(hit_right)
+                {
+                    idx = right;
+                    continue;
+                }
+            }
+
+            /* pop the next subtree that can still hold something closer */
+            bool found = false;
+            while(sp)
+            {
+                idx = stack[--sp];
+                if(*best < 0 || ray_hits_box(&scene->bvh[idx].bounds, o, inv_d, *dist, &t_near))
+                {
+                    found = true;
+                    break;
+                }
+            }
+            if(!found)
+                break;
+        }
+    }
+}
+
+void instances_nearest(const struct scene_t *scene,
+                       vec3 orig, vec3 d, int avoid, scalar *dist, int *best)
+{
+    if(!scene->n_instance_nodes)
+        return;
+
+    scalar o[3] = { orig.x, orig.y, orig.z };
+    scalar inv_d[3] = { 1 / d.x, 1 / d.y, 1 / d.z };
+    scalar t_near;
+
+    int stack[BVH_STACK_SIZE], sp = 0;
+    stack[sp++] = 0;
+    while(sp)
+    {
+        int idx = stack[--sp];
+        const struct instance_node_t *node = scene->instance_bvh + idx;
+        if(!ray_hits_box(&node->bounds, o, inv_d, *best < 0 ? INFINITY : *dist, &t_near))
+            continue;
+        if(node->leaf)
+        {
+            /* an affine map keeps t, so hits compare across spaces */
+            const struct instance_ref_t *ref = scene->instance_refs + node->offset;
+            bvh_nearest(scene, ref->root, ref->handle_offset,
+                        xform_point(ref->to_object, orig), xform_dir(ref->to_object, d),
+                        avoid, dist, best);
+        }
+        else
+        {
+            stack[sp++] = node->offset;
+            stack[sp++] = idx + 1;
+        }
+    }
+}
+
+int scene_intersections(const struct scene_t *scene,
+                        vec3 orig, vec3 d, scalar *dist, int avoid)
+{
+    COUNT(nearest);
+    *dist = -1;
+    int best = -1;
+    scalar t;
+
+    const struct plane_array_t *p = &scene->planes;
+    for(int i = 0; i < p->n; ++i)
+        if(p->id[i] != avoid && plane_intersects(p, i, orig, d, &t))
+            keep_nearest(p->id[i], t, dist, &best);
+
+    if(scene->n_world_nodes)
+        bvh_nearest(scene, 0, 0, orig, d, avoid, dist, &best);
+    instances_nearest(scene, orig, d, avoid, dist, &best);
+    return best;
+}
+
+/* any hit closer than max_dist in the tree at scene->bvh[root] */
+static bool bvh_occluded(const struct scene_t *scene, int root, int offset,
+                         vec3 orig, vec3 d, scalar max_dist, int avoid)
+{
+    scalar o[3] = { orig.x, orig.y, orig.z };
+    scalar inv_d[3] = { 1 / d.x, 1 / d.y, 1 / d.z };
+    scalar t;
+
+    const struct sphere_array_t *s = &scene->spheres;
+    const struct tri_array_t *tri = &scene->tris;
+
+    /* order doesn't matter here, so just walk depth-first */
+    int stack[BVH_STACK_SIZE], sp = 0;
+    stack[sp++] = root;
+    while(sp)
+    {
+        const struct bvh_node_t *node = scene->bvh + stack[--sp];
+        if(!ray_hits_box(&node->bounds, o, inv_d, max_dist, &t))
+            continue;
+        if(bvh_is_leaf(node))
+        {
+            for(int i = node->offset; i < node->offset + node->n_spheres; ++i)
+                if(s->id[i] != avoid && sphere_intersects(s, i, orig, d, &t) && t < max_dist)
+                    return true;
+            for(int i = node->first_tri; i < node->first_tri + node->n_tris; ++i)
+                if(tri->id[i] + offset != avoid && tri_intersects(tri, i, orig, d, &t) && t < max_dist)
+                    return true;
+        }
+        else
+        {
+            stack[sp++] = node->offset;
+            stack[sp++] = node - scene->bvh + 1;
+        }
+    }
+    return false;
+}
+
+bool instances_occluded(const struct scene_t *scene,
+                        vec3 orig, vec3 d, scalar max_dist, int avoid)
+{
+    if(!scene->n_instance_nodes)
+        return false;
+
+    scalar o[3] = { orig.x, orig.y, orig.z };
+    scalar inv_d[3] = { 1 / d.x, 1 / d.y, 1 / d.z };
+    scalar t;
+
+    int stack[BVH_STACK_SIZE], sp = 0;
+    stack[sp++] = 0;
+    while(sp)
+    {
+        int idx = stack[--sp];
+        const struct instance_node_t *node = scene->instance_bvh + idx;
+        if(!ray_hits_box(&node->bounds, o, inv_d, max_dist, &t))
+            continue;
+        if(node->leaf)
+        {
+            const struct instance_ref_t *ref = scene->instance_refs + node->offset;
+            if(bvh_occluded(scene, ref->root, ref->handle_offset,
+                            xform_point(ref->to_object, orig), xform_dir(ref->to_object, d),
+                            max_dist, avoid))
+                return true;
+        }
+        else
+        {
+            stack[sp++] = node->offset;
+            stack[sp++] = idx + 1;
+        }
+    }
+    return false;
+}
+
+/* any-hit query: true if some object other than avoid is hit closer
+ * than max_dist along { orig, d } */
+bool scene_occluded(const struct scene_t *scene,
+                    vec3 orig, vec3 d, scalar max_dist, int avoid)
+{
+    COUNT(occlusion);
+    scalar t;
+
+    const struct plane_array_t *p = &scene->planes;
+    for(int i = 0; i < p->n; ++i)
+        if(p->id[i] != avoid && plane_intersects(p, i, orig, d, &t) && t < max_dist)
+        {
+            COUNT(occluded);
+            return true;
+        }
+
+    if((scene->n_world_nodes && bvh_occluded(scene, 0, 0, orig, d, max_dist, avoid)) ||
+       instances_occluded(scene, orig, d, max_dist, avoid))
+    {
+        COUNT(occluded);
+        return true;
+    }
+    return false;
+}
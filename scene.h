@@ -0,0 +1,274 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vec3.h"
+
+#define MAX(a, b) ((a>b)?(a):(b))
+#define MIN(a, b) ((a<b)?(a):(b))
+#define SQR(a) ((a)*(a))
+#define SIGN(x) ((x)<0?-1:1)
+#define ABS(x) ((x)<0?-(x):(x))
+
+struct rgb_t { unsigned char r, g, b; };
+
+struct material_t {
+    struct rgb_t color;
+    int specularity; /* 0-255 */
+};
+
+/* scene description as filled in by the caller. preprocess_scene()
+ * compiles it into the per-type arrays below, and rendering only ever
+ * looks at those, the lights and the counts of objects, meshes and
+ * instances, so the rest of the description can go once it has run.
+ * an object's index in scene->objects is its handle */
+struct object_t {
+    enum { SPHERE, PLANE, TRI } type;
+    union {
+        struct { vec3 center; scalar radius; } sphere;
+        struct { vec3 point, normal; } plane;
+        struct { vec3 points[3]; } tri;
+    };
+    struct rgb_t color;
+    int specularity; /* 0-255 */
+};
+
+/* an indexed triangle mesh: triangles share vertices and a material.
+ * the triangles of all meshes take the handles after the objects', in
+ * order, so triangle t of the first mesh is handle n_objects + t */
+struct mesh_t {
+    vec3 *verts;
+    int n_verts;
+    int *indices; /* three per triangle */
+    int n_tris;
+    struct rgb_t color;
+    int specularity; /* 0-255 */
+};
+
+/* a copy of a mesh placed by an affine transform, so repeated geometry
+ * is stored and preprocessed once however many copies there are. a
+ * mesh any instance uses is only drawn through its instances. each
+ * instance's triangles take handles after all the meshes', in order,
+ * so triangle t of the first instance is handle
+ * mesh_refs[n_meshes].first_handle + t, and all of them must fit in
+ * an int */
+struct instance_t {
+    int mesh;             /* index in scene->meshes */
+    scalar xform[3][4];   /* object to world; the last column moves */
+    struct rgb_t color;
+    int specularity; /* 0-255 */
+};
+
+/* geometry is stored as one structure of arrays per primitive type, in
+ * BVH leaf order; id maps an entry back to its object handle */
+struct sphere_array_t {
+    scalar *x, *y, *z; /* center */
+    scalar *r2;        /* radius squared */
+    int *id;
+    int n;
+};
+
+struct plane_array_t {
+    scalar *px, *py, *pz; /* a point on the plane */
+    scalar *nx, *ny, *nz;
+    int *id;
+    int n;
+};
+
+/* what the intersection tests read for a triangle: one vertex and the
+ * two edges from it, so a test is a single 36-byte load and none of
+ * the setup (see tri_intersects()) */
+struct tri_record_t {
+    scalar v0[3], e1[3], e2[3];
+};
+
+/* triangles keep their vertex indices too, into vertices shared
+ * between triangles, for normals and anything that moves vertices */
+struct tri_array_t {
+    scalar *x, *y, *z; /* vertices, shared between triangles */
+    int n_verts;
+    int *i0, *i1, *i2;
+    struct tri_record_t *rec;
+    int *id;
+    int n;
+};
+
+/* where an object's geometry ended up; slot is -1 for triangles with
+ * no area, which are dropped. mesh triangles have none, since their
+ * handle says where their vertices are */
+struct prim_ref_t {
+    int type;
+    int slot;
+};
+
+struct light_t {
+    vec3 position;
+    scalar intensity;
+};
+
+/* axis-aligned box, stored as scalar arrays so they can be indexed by axis */
+struct aabb_t {
+    scalar min[3], max[3];
+};
+
+/* where each mesh's triangles and vertices start in the handle space
+ * and in the vertex arrays */
+struct mesh_ref_t {
+    int first_handle;
+    int first_vert;
+};
+
+/* what an instance turns into: rays are moved into its mesh's space
+ * and traced through the tree preprocess_scene() built for the mesh
+ * alone. a triangle's handle in the mesh plus handle_offset is its
+ * handle in the instance */
+struct instance_ref_t {
+    scalar to_object[3][4]; /* the inverse of the instance's xform */
+    scalar normal[3][3];    /* cofactors of xform, taking object normals to world ones */
+    scalar to_world[3][4];  /* the xform itself, for its box */
+    int root;               /* in scene->bvh, -1 if the mesh has nothing to hit */
+    int first_handle;
+    int handle_offset;
+    int moved;              /* since the last refit_instances() */
+};
+
+/* deep enough for a median-split tree over 2^64 objects */
+#define BVH_STACK_SIZE 64
+
+/* nodes are stored depth-first, so an interior node's left child
+ * immediately follows it. a leaf owns a run of spheres and a run of
+ * triangles, so it can test each type in its own tight loop */
+struct bvh_node_t {
+    struct aabb_t bounds;
+    int offset;    /* interior: right child, leaf: first sphere */
+    int first_tri;
+    int n_spheres, n_tris; /* both 0 for interior nodes */
+};
+
+/* the top level of the two-level tree over instances, one instance
+ * per leaf; stored depth-first like struct bvh_node_t */
+struct instance_node_t {
+    struct aabb_t bounds;
+    int offset; /* interior: right child, leaf: index in scene->instance_refs */
+    int leaf;
+};
+
+/* the lights get a tree of their own, split the same way but down to
+ * one light per leaf, so shading can skip or sample whole groups of
+ * them; stored depth-first like struct bvh_node_t */
+struct light_node_t {
+    struct aabb_t bounds;
+    scalar intensity; /* summed over the subtree */
+    int offset;       /* interior: right child, leaf: index in scene->lights */
+    int leaf;
+};
+
+struct scene_t {
+    struct rgb_t bg;
+    struct object_t *objects;
+    size_t n_objects;
+    struct mesh_t *meshes;
+    size_t n_meshes;
+    struct instance_t *instances;
+    size_t n_instances;
+    struct light_t *lights;
+    size_t n_lights;
+    scalar ambient;
+
+    /* filled in by preprocess_scene() */
+    struct material_t *materials; /* by handle for objects, then one per mesh and instance */
+    struct prim_ref_t *prims;     /* by handle, objects only */
+    struct mesh_ref_t *mesh_refs; /* n_meshes + 1, the last one past the end */
+    int *mesh_slots;              /* by handle - n_objects, -1 if dropped */
+    struct sphere_array_t spheres;
+    struct plane_array_t planes;  /* unbounded, tested linearly */
+    struct tri_array_t tris;
+    struct bvh_node_t *bvh;       /* the world's tree, then one per instanced mesh */
+    int n_bvh_nodes;
+    int n_world_nodes;
+    struct instance_ref_t *instance_refs;
+    struct instance_node_t *instance_bvh;
+    int n_instance_nodes;
+    struct light_node_t *light_bvh;
+    int n_light_nodes;
+
+    /* a scene read from a cache file (see scenefile.h) has all of the
+     * above pointing into this mapping */
+    void *cache;
+    size_t cache_size;
+};
+
+static inline bool bvh_is_leaf(const struct bvh_node_t *node)
+{
+    return node->n_spheres || node->n_tris;
+}
+
+static inline vec3 tri_vertex(const struct tri_array_t *tri, int v)
+{
+    return vec3_make(tri->x[v], tri->y[v], tri->z[v]);
+}
+
+/* index in scene->meshes of the mesh a triangle handle belongs to */
+int scene_mesh(const struct scene_t *scene, int handle);
+
+static inline bool scene_is_instance(const struct scene_t *scene, int handle)
+{
+    return handle >= scene->mesh_refs[scene->n_meshes].first_handle;
+}
+
+/* index in scene->instance_refs of the instance a handle belongs to */
+int scene_instance(const struct scene_t *scene, int handle);
+
+static inline struct material_t *scene_material(const struct scene_t *scene, int handle)
+{
+    if(handle < scene->n_objects)
+        return scene->materials + handle;
+    if(scene_is_instance(scene, handle))
+        return scene->materials + scene->n_objects + scene->n_meshes + scene_instance(scene, handle);
+    return scene->materials + scene->n_objects + scene_mesh(scene, handle);
+}
+
+bool sphere_intersects(const struct sphere_array_t *s, int i, vec3 o, vec3 d, scalar *t);
+bool plane_intersects(const struct plane_array_t *p, int i, vec3 o, vec3 d, scalar *t);
+bool tri_intersects(const struct tri_array_t *tri, int i, vec3 o, vec3 d, scalar *t);
+
+void preprocess_scene(struct scene_t *scene);
+void free_scene(struct scene_t *scene);
+
+void free_mesh(struct mesh_t *mesh);
+
+/* sets xform to scale, then turn by angles (radians) about x, y and z
+ * in that order, then move to pos */
+void instance_transform(struct instance_t *inst, vec3 pos, vec3 angles, scalar scale);
+
+/* gives compiled instance k a new transform, which rays see once
+ * refit_instances() has run; nothing may be tracing meanwhile */
+void scene_move_instance(struct scene_t *scene, int k, const scalar xform[3][4]);
+
+/* brings the instances' tree up to date after moves by refitting it
+ * in place: only the boxes of moved instances and of the nodes above
+ * them change. the tree keeps the shape it was built with, so it gets
+ * slower, but never wrong, as instances wander from where they
+ * started */
+void refit_instances(struct scene_t *scene);
+
+/* handle of the nearest object along { orig, d }, or -1; avoid is a
+ * handle to ignore, or -1 */
+int scene_intersections(const struct scene_t *scene,
+                        vec3 orig, vec3 d, scalar *dist, int avoid);
+bool scene_occluded(const struct scene_t *scene,
+                    vec3 orig, vec3 d, scalar max_dist, int avoid);
+
+/* the instances' share of the two above, for the packet kernels to
+ * finish lanes with; *best is -1 or a hit at *dist, and only nearer
+ * hits replace it */
+void instances_nearest(const struct scene_t *scene,
+                       vec3 orig, vec3 d, int avoid, scalar *dist, int *best);
+bool instances_occluded(const struct scene_t *scene,
+                        vec3 orig, vec3 d, scalar max_dist, int avoid);
+
+vec3 normal_at_point(const struct scene_t *scene, int handle, vec3 pt);
+
+#endif
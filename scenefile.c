@@ -0,0 +1,570 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "obj.h"
+#include "scenefile.h"
+
+#define NAME_LEN 64
+
+struct named_material_t {
+    char name[NAME_LEN];
+    struct material_t mat;
+};
+
+/* doubles the capacity of a growable array when it is full */
+static void *grow(void *arr, int n, int *cap, size_t size)
+{
+    if(n < *cap)
+        return arr;
+    *cap = *cap ? *cap * 2 : 16;
+    return realloc(arr, size * *cap);
+}
+
+static const struct material_t *find_material(const struct named_material_t *mats, int n,
+                                              const char *name)
+{
+    for(int i = n - 1; i >= 0; --i)
+        if(!strcmp(mats[i].name, name))
+            return &mats[i].mat;
+    return NULL;
+}
+
+/* a mesh path relative to the directory of the scene file */
+static void relative_path(char *out, size_t len, const char *scene_path, const char *path)
+{
+    const char *slash = strrchr(scene_path, '/');
+    if(path[0] == '/' || !slash)
+        snprintf(out, len, "%s", path);
+    else
+        snprintf(out, len, "%.*s/%s", (int)(slash - scene_path), scene_path, path);
+}
+
+/* what load_scene() has built so far */
+struct loader_t {
+    const char *path;
+    int n_threads;
+    struct scene_t *scene;
+    struct camera_t *cam;
+    struct object_t *objects;
+    struct light_t *lights;
+    struct mesh_t *meshes;
+    struct instance_t *instances;
+    struct named_material_t *mats;
+    int n_objects, n_lights, n_meshes, n_instances, n_mats;
+    int objects_cap, lights_cap, meshes_cap, instances_cap, mats_cap;
+};
+
+/* the material named after an item's last number, or the default if
+ * there is nothing there; NULL if there is no such material */
+static const struct material_t *item_material(const struct loader_t *ld, const char *rest)
+{
+    char name[NAME_LEN];
+    if(sscanf(rest, "%63s", name) != 1)
+        return &ld->mats[0].mat;
+    return find_material(ld->mats, ld->n_mats, name);
+}
+
+static const char *add_object(struct loader_t *ld, const struct object_t *obj, const char *rest)
+{
+    const struct material_t *mat = item_material(ld, rest);
+    if(!mat)
+        return "no such material";
+    ld->objects = grow(ld->objects, ld->n_objects, &ld->objects_cap, sizeof(struct object_t));
+    struct object_t *out = ld->objects + ld->n_objects++;
+    *out = *obj;
+    out->color = mat->color;
+    out->specularity = mat->specularity;
+    return NULL;
+}
+
+/* colours and specularities are stored in bytes */
+static bool bytes_ok(const int *c, int n)
+{
+    for(int i = 0; i < n; ++i)
+        if(c[i] < 0 || c[i] > 255)
+            return false;
+    return true;
+}
+
+/* every object, mesh triangle and instanced triangle takes a handle,
+ * which is an int */
+static bool handles_fit(const struct loader_t *ld)
+{
+    long handles = ld->n_objects;
+    for(int i = 0; i < ld->n_meshes; ++i)
+        handles += ld->meshes[i].n_tris;
+    for(int i = 0; i < ld->n_instances; ++i)
+        handles += ld->meshes[ld->instances[i].mesh].n_tris;
+    return handles <= INT_MAX;
+}
+
+/* one line, with any comment already cut off; returns what was wrong
+ * with it, or NULL */
+static const char *parse_line(struct loader_t *ld, const char *line)
+{
+    char word[NAME_LEN], name[NAME_LEN], file[4096];
+    double v[9];
+    int c[4], used;
+    if(sscanf(line, "%63s%n", word, &used) != 1)
+        return NULL;
+    const char *rest = line + used;
+
+    struct object_t obj;
+    if(!strcmp(word, "background"))
+    {
+        if(sscanf(rest, "%d %d %d", c, c + 1, c + 2) != 3)
+            return "expected background r g b";
+        if(!bytes_ok(c, 3))
+            return "colours are 0-255";
+        ld->scene->bg = (struct rgb_t) { c[0], c[1], c[2] };
+    }
+    else if(!strcmp(word, "ambient"))
+    {
+        if(sscanf(rest, "%lf", v) != 1)
+            return "expected ambient level";
+        ld->scene->ambient = v[0];
+    }
+    else if(!strcmp(word, "camera"))
+    {
+        if(sscanf(rest, "%lf %lf %lf %lf %lf %lf %lf %lf",
+                  v, v + 1, v + 2, v + 3, v + 4, v + 5, v + 6, v + 7) != 8)
+            return "expected camera x y z dx dy dz fov_x fov_y";
+        ld->cam->origin = vec3_make(v[0], v[1], v[2]);
+        ld->cam->direction = camera_direction(vec3_make(v[3], v[4], v[5]));
+        ld->cam->fov_x = v[6] * M_PI / 180;
+        ld->cam->fov_y = v[7] * M_PI / 180;
+    }
+    else if(!strcmp(word, "material"))
+    {
+        if(sscanf(rest, "%63s %d %d %d %d", name, c, c + 1, c + 2, c + 3) != 5)
+            return "expected material name r g b specularity";
+        if(!bytes_ok(c, 4))
+            return "colours and specularity are 0-255";
+        ld->mats = grow(ld->mats, ld->n_mats, &ld->mats_cap, sizeof(struct named_material_t));
+        struct named_material_t *m = ld->mats + ld->n_mats++;
+        strcpy(m->name, name);
+        m->mat.color = (struct rgb_t) { c[0], c[1], c[2] };
+        m->mat.specularity = c[3];
+    }
+    else if(!strcmp(word, "sphere"))
+    {
+        if(sscanf(rest, "%lf %lf %lf %lf%n", v, v + 1, v + 2, v + 3, &used) != 4)
+            return "expected sphere x y z radius [material]";
+        obj.type = SPHERE;
+        obj.sphere.center = vec3_make(v[0], v[1], v[2]);
+        obj.sphere.radius = v[3];
+        return add_object(ld, &obj, rest + used);
+    }
+    else if(!strcmp(word, "plane"))
+    {
+        if(sscanf(rest, "%lf %lf %lf %lf %lf %lf%n", v, v + 1, v + 2, v + 3, v + 4, v + 5, &used) != 6)
+            return "expected plane x y z nx ny nz [material]";
+        obj.type = PLANE;
+        obj.plane.point = vec3_make(v[0], v[1], v[2]);
+        obj.plane.normal = vec3_make(v[3], v[4], v[5]);
+        return add_object(ld, &obj, rest + used);
+    }
+    else if(!strcmp(word, "tri"))
+    {
+        if(sscanf(rest, "%lf %lf %lf %lf %lf %lf %lf %lf %lf%n",
+                  v, v + 1, v + 2, v + 3, v + 4, v + 5, v + 6, v + 7, v + 8, &used) != 9)
+            return "expected tri x y z x y z x y z [material]";
+        obj.type = TRI;
+        for(int i = 0; i < 3; ++i)
+            obj.tri.points[i] = vec3_make(v[3 * i], v[3 * i + 1], v[3 * i + 2]);
+        return add_object(ld, &obj, rest + used);
+    }
+    else if(!strcmp(word, "mesh"))
+    {
+        if(sscanf(rest, "%4095s%n", file, &used) != 1)
+            return "expected mesh file.obj [material]";
+        const struct material_t *mat = item_material(ld, rest + used);
+        if(!mat)
+            return "no such material";
+        char full[2 * sizeof(file)];
+        relative_path(full, sizeof(full), ld->path, file);
+        struct mesh_t mesh;
+        if(!load_obj(full, &mesh, ld->n_threads))
+            return "mesh didn't load";
+        mesh.color = mat->color;
+        mesh.specularity = mat->specularity;
+        ld->meshes = grow(ld->meshes, ld->n_meshes, &ld->meshes_cap, sizeof(struct mesh_t));
+        ld->meshes[ld->n_meshes++] = mesh;
+    }
+    else if(!strcmp(word, "instance"))
+    {
+        if(sscanf(rest, "%d %lf %lf %lf %lf %lf %lf %lf%n",
+                  c, v, v + 1, v + 2, v + 3, v + 4, v + 5, v + 6, &used) != 8)
+            return "expected instance mesh x y z rx ry rz scale [material]";
+        if(c[0] < 0 || c[0] >= ld->n_meshes)
+            return "no such mesh";
+        if(v[6] == 0)
+            return "instance scale can't be 0";
+        /* a copy keeps its mesh's material unless it names another */
+        const struct material_t *mat = NULL;
+        if(sscanf(rest + used, "%63s", name) == 1 && !(mat = find_material(ld->mats, ld->n_mats, name)))
+            return "no such material";
+        ld->instances = grow(ld->instances, ld->n_instances, &ld->instances_cap, sizeof(struct instance_t));
+        struct instance_t *inst = ld->instances + ld->n_instances++;
+        inst->mesh = c[0];
+        instance_transform(inst, vec3_make(v[0], v[1], v[2]),
+                           vec3_make(v[3] * M_PI / 180, v[4] * M_PI / 180, v[5] * M_PI / 180), v[6]);
+        inst->color = mat ? mat->color : ld->meshes[c[0]].color;
+        inst->specularity = mat ? mat->specularity : ld->meshes[c[0]].specularity;
+    }
+    else if(!strcmp(word, "light"))
+    {
+        if(sscanf(rest, "%lf %lf %lf %lf", v, v + 1, v + 2, v + 3) != 4)
+            return "expected light x y z intensity";
+        ld->lights = grow(ld->lights, ld->n_lights, &ld->lights_cap, sizeof(struct light_t));
+        struct light_t *light = ld->lights + ld->n_lights++;
+        light->position = vec3_make(v[0], v[1], v[2]);
+        light->intensity = v[3];
+    }
+    else
+        return "unknown item";
+    return NULL;
+}
+
+bool load_scene(const char *path, struct scene_t *scene, struct camera_t *cam, int n_threads)
+{
+    FILE *f = fopen(path, "r");
+    if(!f)
+    {
+        perror(path);
+        return false;
+    }
+
+    struct loader_t ld;
+    memset(&ld, 0, sizeof(ld));
+    ld.path = path;
+    ld.n_threads = n_threads;
+    ld.scene = scene;
+    ld.cam = cam;
+
+    ld.mats = grow(ld.mats, 0, &ld.mats_cap, sizeof(struct named_material_t));
+    strcpy(ld.mats[0].name, "default");
+    ld.mats[0].mat.color = (struct rgb_t) { 0xff, 0xff, 0xff };
+    ld.mats[0].mat.specularity = 0;
+    ld.n_mats = 1;
+
+    scene->bg = (struct rgb_t) { 0x87, 0xce, 0xeb };
+    scene->ambient = .2;
+
+    char line[4096];
+    bool ok = true;
+    for(int line_no = 1; ok && fgets(line, sizeof(line), f); ++line_no)
+    {
+        char *hash = strchr(line, '#');
+        if(hash)
+            *hash = '\0';
+        const char *err = parse_line(&ld, line);
+        if(err)
+        {
+            fprintf(stderr, "%s:%d: %s\n", path, line_no, err);
+            ok = false;
+        }
+    }
+    if(ferror(f))
+    {
+        perror(path);
+        ok = false;
+    }
+    fclose(f);
+    free(ld.mats);
+    if(ok && !handles_fit(&ld))
+    {
+        fprintf(stderr, "%s: too many instanced triangles\n", path);
+        ok = false;
+    }
+
+    scene->objects = ld.objects;
+    scene->n_objects = ld.n_objects;
+    scene->lights = ld.lights;
+    scene->n_lights = ld.n_lights;
+    scene->meshes = ld.meshes;
+    scene->n_meshes = ld.n_meshes;
+    scene->instances = ld.instances;
+    scene->n_instances = ld.n_instances;
+    if(!ok)
+    {
+        free_scene_description(scene);
+        free(scene->lights);
+        scene->lights = NULL;
+    }
+    return ok;
+}
+
+void free_scene_description(struct scene_t *scene)
+{
+    for(int i = 0; scene->meshes && i < scene->n_meshes; ++i)
+        free_mesh(scene->meshes + i);
+    free(scene->objects);
+    free(scene->meshes);
+    free(scene->instances);
+    scene->objects = NULL;
+    scene->meshes = NULL;
+    scene->instances = NULL;
+}
+
+/* bump when the layout of the cache or anything in it changes */
+#define CACHE_VERSION 6
+#define CACHE_ALIGN 64
+
+struct cache_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; /* 0x01020304 as the writer saw it */
+    uint32_t sizes;      /* of the types stored, see cache_sizes() */
+    uint32_t n_sections;
+    uint64_t size;       /* of the whole file */
+
+    struct rgb_t bg;
+    scalar ambient;
+    scalar cam_origin[3], cam_dir[3], cam_fov[2];
+
+    int32_t n_objects, n_meshes, n_instances, n_lights;
+    int32_t n_spheres, n_planes, n_tris, n_verts, n_mesh_tris, n_bvh_nodes, n_world_nodes;
+    int32_t n_instance_nodes, n_light_nodes;
+    uint64_t offsets[32];
+};
+
+struct section_t {
+    void **ptr;
+    size_t size;
+};
+
+/* a build whose structures are laid out differently shouldn't use
+ * another's cache; this won't catch everything, but the version
+ * number covers deliberate changes */
+static uint32_t cache_sizes(void)
+{
+    const size_t sizes[] = { sizeof(scalar), sizeof(struct light_t), sizeof(struct material_t),
+                             sizeof(struct prim_ref_t), sizeof(struct mesh_ref_t),
+                             sizeof(struct bvh_node_t), sizeof(struct tri_record_t),
+                             sizeof(struct light_node_t), sizeof(struct instance_ref_t),
+                             sizeof(struct instance_node_t) };
+    uint32_t h = 0;
+    for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        h = h * 31 + sizes[i];
+    return h;
+}
+
+/* every array of a compiled scene, in file order, sized from the
+ * counts in scene (and n_mesh_tris, which it doesn't keep) */
+static int cache_sections(struct scene_t *scene, int n_mesh_tris, struct section_t *out)
+{
+    int n = 0;
+#define SECTION(p, count) (out[n].ptr = (void **)&(p), out[n].size = sizeof(*(p)) * (count), ++n)
+    SECTION(scene->lights, scene->n_lights);
+    SECTION(scene->materials, scene->n_objects + scene->n_meshes + scene->n_instances);
+    SECTION(scene->prims, scene->n_objects);
+    SECTION(scene->mesh_refs, scene->n_meshes + 1);
+    SECTION(scene->mesh_slots, n_mesh_tris);
+
+    struct sphere_array_t *s = &scene->spheres;
+    SECTION(s->x, s->n);
+    SECTION(s->y, s->n);
+    SECTION(s->z, s->n);
+    SECTION(s->r2, s->n);
+    SECTION(s->id, s->n);
+
+    struct plane_array_t *p = &scene->planes;
+    SECTION(p->px, p->n);
+    SECTION(p->py, p->n);
+    SECTION(p->pz, p->n);
+    SECTION(p->nx, p->n);
+    SECTION(p->ny, p->n);
+    SECTION(p->nz, p->n);
+    SECTION(p->id, p->n);
+
+    struct tri_array_t *t = &scene->tris;
+    SECTION(t->x, t->n_verts);
+    SECTION(t->y, t->n_verts);
+    SECTION(t->z, t->n_verts);
+    SECTION(t->i0, t->n);
+    SECTION(t->i1, t->n);
+    SECTION(t->i2, t->n);
+    SECTION(t->rec, t->n);
+    SECTION(t->id, t->n);
+
+    SECTION(scene->bvh, scene->n_bvh_nodes);
+    SECTION(scene->instance_refs, scene->n_instances);
+    SECTION(scene->instance_bvh, scene->n_instance_nodes);
+    SECTION(scene->light_bvh, scene->n_light_nodes);
+#undef SECTION
+    return n;
+}
+
+static uint64_t align_up(uint64_t x)
+{
+    return (x + CACHE_ALIGN - 1) & ~(uint64_t)(CACHE_ALIGN - 1);
+}
+
+bool save_scene_cache(const char *path, const struct scene_t *scene, const struct camera_t *cam)
+{
+    struct cache_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "rtcache", 8);
+    h.version = CACHE_VERSION;
+    h.byte_order = 0x01020304;
+    h.sizes = cache_sizes();
+
+    h.bg = scene->bg;
+    h.ambient = scene->ambient;
+    vector dir = cam->direction;
+    vect_to_rect(&dir);
+    h.cam_origin[0] = cam->origin.x;
+    h.cam_origin[1] = cam->origin.y;
+    h.cam_origin[2] = cam->origin.z;
+    h.cam_dir[0] = dir.rect.x;
+    h.cam_dir[1] = dir.rect.y;
+    h.cam_dir[2] = dir.rect.z;
+    h.cam_fov[0] = cam->fov_x;
+    h.cam_fov[1] = cam->fov_y;
+
+    h.n_objects = scene->n_objects;
+    h.n_meshes = scene->n_meshes;
+    h.n_instances = scene->n_instances;
+    h.n_lights = scene->n_lights;
+    h.n_spheres = scene->spheres.n;
+    h.n_planes = scene->planes.n;
+    h.n_tris = scene->tris.n;
+    h.n_verts = scene->tris.n_verts;
+    h.n_mesh_tris = scene->mesh_refs[scene->n_meshes].first_handle - scene->n_objects;
+    h.n_bvh_nodes = scene->n_bvh_nodes;
+    h.n_world_nodes = scene->n_world_nodes;
+    h.n_instance_nodes = scene->n_instance_nodes;
+    h.n_light_nodes = scene->n_light_nodes;
+
+    /* only read through the sections, so casting away const is fine */
+    struct section_t sections[32];
+    int n = cache_sections((struct scene_t *)scene, h.n_mesh_tris, sections);
+    h.n_sections = n;
+    uint64_t offset = align_up(sizeof(h));
+    for(int i = 0; i < n; ++i)
+    {
+        h.offsets[i] = offset;
+        offset = align_up(offset + sections[i].size);
+    }
+    h.size = offset;
+
+    char tmp[strlen(path) + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if(!f)
+    {
+        perror(tmp);
+        return false;
+    }
+    static const char zeros[CACHE_ALIGN];
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    uint64_t pos = sizeof(h);
+    for(int i = 0; ok && i <= n; ++i)
+    {
+        uint64_t next = i < n ? h.offsets[i] : h.size;
+        ok = fwrite(zeros, 1, next - pos, f) == next - pos;
+        pos = next;
+        if(ok && i < n && sections[i].size)
+        {
+            ok = fwrite(*sections[i].ptr, 1, sections[i].size, f) == sections[i].size;
+            pos += sections[i].size;
+        }
+    }
+    if(fclose(f) || !ok)
+    {
+        perror(tmp);
+        unlink(tmp);
+        return false;
+    }
+    if(rename(tmp, path))
+    {
+        perror(path);
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+bool map_scene_cache(const char *path, struct scene_t *scene, struct camera_t *cam)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        if(errno != ENOENT)
+            perror(path);
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < sizeof(struct cache_header_t))
+    {
+        fprintf(stderr, "%s: not a scene cache\n", path);
+        close(fd);
+        return false;
+    }
+
+    /* private and writable, so materials can still be edited */
+    void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        perror(path);
+        return false;
+    }
+
+    const struct cache_header_t *h = data;
+    if(memcmp(h->magic, "rtcache", 8) || h->version != CACHE_VERSION ||
+       h->byte_order != 0x01020304 || h->sizes != cache_sizes() || h->size != st.st_size)
+    {
+        fprintf(stderr, "%s: not a scene cache for this build\n", path);
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    memset(scene, 0, sizeof(*scene));
+    scene->bg = h->bg;
+    scene->ambient = h->ambient;
+    scene->n_objects = h->n_objects;
+    scene->n_meshes = h->n_meshes;
+    scene->n_instances = h->n_instances;
+    scene->n_lights = h->n_lights;
+    scene->spheres.n = h->n_spheres;
+    scene->planes.n = h->n_planes;
+    scene->tris.n = h->n_tris;
+    scene->tris.n_verts = h->n_verts;
+    scene->n_bvh_nodes = h->n_bvh_nodes;
+    scene->n_world_nodes = h->n_world_nodes;
+    scene->n_instance_nodes = h->n_instance_nodes;
+    scene->n_light_nodes = h->n_light_nodes;
+
+    struct section_t sections[32];
+    int n = cache_sections(scene, h->n_mesh_tris, sections);
+    for(int i = 0; i < n; ++i)
+    {
+        if(n != h->n_sections || h->offsets[i] % CACHE_ALIGN ||
+           h->offsets[i] > h->size || sections[i].size > h->size - h->offsets[i])
+        {
+            fprintf(stderr, "%s: corrupt scene cache\n", path);
+            munmap(data, st.st_size);
+            memset(scene, 0, sizeof(*scene));
+            return false;
+        }
+        *sections[i].ptr = (char *)data + h->offsets[i];
+    }
+    scene->cache = data;
+    scene->cache_size = st.st_size;
+
+    cam->origin = vec3_make(h->cam_origin[0], h->cam_origin[1], h->cam_origin[2]);
+    cam->direction = (vector) { RECT, { .rect = { h->cam_dir[0], h->cam_dir[1], h->cam_dir[2] } } };
+    cam->fov_x = h->cam_fov[0];
+    cam->fov_y = h->cam_fov[1];
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include <stdbool.h>
+
+#include "camera.h"
+#include "scene.h"
+
+/* text scenes, one item per line and '#' to the end of a line a
+ * comment; angles are in degrees and colours 0-255:
+ *
+ *   background r g b
+ *   ambient level
+ *   camera x y z  dx dy dz  fov_x fov_y
+ *   material name r g b specularity
+ *   sphere x y z radius [material]
+ *   plane x y z  nx ny nz [material]
+ *   tri x y z  x y z  x y z [material]
+ *   mesh file.obj [material]
+ *   instance mesh  x y z  rx ry rz  scale [material]
+ *   light x y z intensity
+ *
+ * materials must be defined before they are used, and mesh paths are
+ * relative to the scene file. an instance is a copy of the mesh-th
+ * mesh (from 0), scaled, turned about x, y and z in that order and
+ * moved to x y z, in its mesh's material unless it names one; a mesh
+ * with instances is only drawn through them. the camera looks along
+ * dx dy dz.
+ *
+ * load_scene() fills in the description part of scene, and cam if the
+ * file has a camera line; n_threads is passed on to load_obj(). on
+ * failure a message goes to stderr and false is returned */
+bool load_scene(const char *path, struct scene_t *scene, struct camera_t *cam, int n_threads);
+
+/* frees the objects, meshes and instances load_scene() allocated, keeping the
+ * counts a compiled scene still needs; fine to call once
+ * preprocess_scene() has run. the lights are rendered from directly,
+ * so they stay until they are free()d after free_scene() */
+void free_scene_description(struct scene_t *scene);
+
+/* a compiled scene and its camera as one file that map_scene_cache()
+ * can map and use as is, with no parsing or preprocessing. the file
+ * is only good for a build with the same types and byte order, and is
+ * rejected otherwise. writes go to a temporary file renamed into
+ * place, so concurrent readers never see half a cache */
+bool save_scene_cache(const char *path, const struct scene_t *scene, const struct camera_t *cam);
+
+/* on success scene is ready to render and free_scene() unmaps it;
+ * returns false quietly if there is no such file */
+bool map_scene_cache(const char *path, struct scene_t *scene, struct camera_t *cam);
+
+#endif
@@ -0,0 +1,411 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "camera.h"
+#include "framebuffer.h"
+#include "server.h"
+
+/* pixels a client gets rendered per turn */
+#define QUANTUM 16384
+/* a client with more than this many bytes of replies unread gets no
+ * turns until it catches up */
+#define MAX_BACKLOG (8 * 3 * QUANTUM)
+#define MAX_CLIENTS 64
+#define MAX_LINE 1024
+/* largest frame side a request can ask for */
+#define MAX_SIZE 16384
+
+struct request_t {
+    char id[64];
+    const char *error;         /* reply with this rather than render */
+    struct camera_view_t view; /* of the region alone */
+    int bounces;
+    int y;                     /* rows of the region sent */
+    struct request_t *next;
+};
+
+struct client_t {
+    int in_fd, out_fd;
+    char line[MAX_LINE];
+    int line_len;
+    bool skipping; /* the rest of a line too long to take */
+    bool eof;      /* no more requests coming */
+    bool dead;     /* can't be written to, so drop it */
+    char *out;     /* replies waiting to go */
+    size_t out_len, out_sent, out_cap;
+    struct request_t *head, *tail;
+};
+
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void append(struct client_t *c, const void *data, size_t n)
+{
+    if(c->out_sent == c->out_len)
+        c->out_sent = c->out_len = 0;
+    if(c->out_len + n > c->out_cap && c->out_sent)
+    {
+        memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+        c->out_len -= c->out_sent;
+        c->out_sent = 0;
+    }
+    if(c->out_len + n > c->out_cap)
+    {
+        c->out_cap = MAX(2 * c->out_cap, c->out_len + n);
+        c->out = realloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_len, data, n);
+    c->out_len += n;
+}
+
+static void flush(struct client_t *c)
+{
+    while(c->out_sent < c->out_len)
+    {
+        ssize_t n = write(c->out_fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if(n <= 0)
+        {
+            c->dead = true;
+            return;
+        }
+        c->out_sent += n;
+    }
+}
+
+static void push(struct client_t *c, struct request_t *req)
+{
+    req->next = NULL;
+    if(c->tail)
+        c->tail->next = req;
+    else
+        c->head = req;
+    c->tail = req;
+}
+
+static void pop(struct client_t *c)
+{
+    struct request_t *req = c->head;
+    c->head = req->next;
+    if(!c->head)
+        c->tail = NULL;
+    camera_view_free(&req->view);
+    free(req);
+}
+
+/* a request for a line, which may be one that only carries an error;
+ * NULL for a blank line */
+static struct request_t *parse_request(const char *line)
+{
+    char word[16];
+    if(sscanf(line, "%15s", word) != 1)
+        return NULL;
+    struct request_t *req = calloc(1, sizeof(*req));
+    strcpy(req->id, "-");
+
+    int w, h, x0, y0, x1, y1, used;
+    double v[8];
+    if(strcmp(word, "render"))
+    {
+        req->error = "unknown request";
+        return req;
+    }
+    if(sscanf(line, "%*s %63s%n", req->id, &used) != 1 ||
+       sscanf(line + used, "%d %d %d %d %d %d %d %lf %lf %lf %lf %lf %lf %lf %lf",
+              &w, &h, &x0, &y0, &x1, &y1, &req->bounces,
+              v, v + 1, v + 2, v + 3, v + 4, v + 5, v + 6, v + 7) != 15)
+        req->error = "expected render id w h x0 y0 x1 y1 bounces x y z dx dy dz fov_x fov_y";
+    else if(w < 1 || h < 1 || w > MAX_SIZE || h > MAX_SIZE)
+        req->error = "bad resolution";
+    else if(x0 < 0 || y0 < 0 || x1 > w || y1 > h || x0 >= x1 || y0 >= y1)
+        req->error = "bad region";
+    else if(req->bounces < 0 || req->bounces > MAX_BOUNCES)
+        req->error = "bad bounce count";
+    else if(!(v[6] > 0 && v[6] < 360 && v[7] > 0 && v[7] < 360))
+        req->error = "bad field of view";
+    if(req->error)
+        return req;
+
+    struct camera_t cam;
+    cam.origin = vec3_make(v[0], v[1], v[2]);
+    cam.direction = camera_direction(vec3_make(v[3], v[4], v[5]));
+    cam.fov_x = v[6] * M_PI / 180;
+    cam.fov_y = v[7] * M_PI / 180;
+    struct camera_view_t full = { 0 };
+    camera_view_update(&full, &cam, w, h);
+    camera_view_crop(&req->view, &full, x0, y0, x1 - x0, y1 - y0);
+    camera_view_free(&full);
+    return req;
+}
+
+/* takes in whatever the client has sent and queues each whole line */
+static void read_client(struct client_t *c)
+{
+    char buf[4096];
+    ssize_t n;
+    while((n = read(c->in_fd, buf, sizeof(buf))) != 0)
+    {
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if(n < 0)
+            break;
+        for(int i = 0; i < n; ++i)
+        {
+            if(buf[i] != '\n')
+            {
+                if(c->line_len < MAX_LINE - 1)
+                    c->line[c->line_len++] = buf[i];
+                else
+                    c->skipping = true;
+                continue;
+            }
+            c->line[c->line_len] = '\0';
+            struct request_t *req = parse_request(c->line);
+            if(c->skipping)
+            {
+                if(!req)
+                    req = calloc(1, sizeof(*req));
+                strcpy(req->id, "-");
+                req->error = "line too long";
+            }
+            if(req)
+                push(c, req);
+            c->line_len = 0;
+            c->skipping = false;
+        }
+    }
+
+    /* the end of the input, or an error reading it; a last line with
+     * no newline still counts */
+    c->eof = true;
+    c->line[c->line_len] = '\0';
+    struct request_t *req = c->skipping ? NULL : parse_request(c->line);
+    if(req)
+        push(c, req);
+    c->line_len = 0;
+}
+
+static struct client_t *add_client(struct client_t **clients, int *n, int in_fd, int out_fd)
+{
+    struct client_t *c = calloc(1, sizeof(*c));
+    c->in_fd = in_fd;
+    c->out_fd = out_fd;
+    set_nonblocking(in_fd);
+    set_nonblocking(out_fd);
+    clients[(*n)++] = c;
+    return c;
+}
+
+/* whether a client should get a turn */
+static bool runnable(const struct client_t *c)
+{
+    return c->head && !c->dead && c->out_len - c->out_sent < MAX_BACKLOG;
+}
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    /* a socket left behind by an earlier server would make bind() fail */
+    struct stat st;
+    if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+    {
+        perror(path);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    set_nonblocking(fd);
+    return fd;
+}
+
+/* one round of I/O on everything: new clients, requests in, replies
+ * out. waits for something to happen only if block is set */
+static void poll_clients(int listen_fd, struct client_t **clients, int *n_clients, bool block)
+{
+    struct pollfd fds[2 * MAX_CLIENTS + 1];
+    int n_fds = 0, where[2 * MAX_CLIENTS + 1];
+    if(listen_fd >= 0)
+    {
+        fds[n_fds] = (struct pollfd) { listen_fd, POLLIN, 0 };
+        where[n_fds++] = -1;
+    }
+    for(int i = 0; i < *n_clients; ++i)
+    {
+        struct client_t *c = clients[i];
+        if(c->dead)
+            continue;
+        if(!c->eof)
+        {
+            fds[n_fds] = (struct pollfd) { c->in_fd, POLLIN, 0 };
+            where[n_fds++] = i;
+        }
+        if(c->out_sent < c->out_len)
+        {
+            fds[n_fds] = (struct pollfd) { c->out_fd, POLLOUT, 0 };
+            where[n_fds++] = i;
+        }
+    }
+    if(!n_fds || poll(fds, n_fds, block ? -1 : 0) <= 0)
+        return;
+
+    for(int i = 0; i < n_fds; ++i)
+    {
+        if(!fds[i].revents)
+            continue;
+        if(where[i] < 0)
+        {
+            int fd;
+            while((fd = accept(listen_fd, NULL, NULL)) >= 0)
+            {
+                if(*n_clients < MAX_CLIENTS)
+                    add_client(clients, n_clients, fd, fd);
+                else
+                    close(fd);
+            }
+            continue;
+        }
+        struct client_t *c = clients[where[i]];
+        if(fds[i].events & POLLIN)
+            read_client(c);
+        else
+            flush(c);
+    }
+}
+
+bool serve(const char *path, int in_fd, int out_fd, struct render_pool_t *pool,
+           const struct scene_t *scene, const struct render_opts_t *opts)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    struct client_t *clients[MAX_CLIENTS];
+    int n_clients = 0, listen_fd = -1;
+    if(path)
+    {
+        listen_fd = open_socket(path);
+        if(listen_fd < 0)
+            return false;
+        printf("%s: listening\n", path);
+        fflush(stdout);
+    }
+    /* the caller's descriptors go back to how they were afterwards */
+    int in_flags = fcntl(in_fd, F_GETFL), out_flags = fcntl(out_fd, F_GETFL);
+    if(!path)
+        add_client(clients, &n_clients, in_fd, out_fd);
+
+    struct render_opts_t req_opts = *opts;
+    req_opts.progress = false;
+    unsigned char *pixels = NULL;
+    size_t pixels_size = 0;
+
+    /* round robin by turns of QUANTUM pixels; each turn's band renders
+     * while the round of I/O after it goes on */
+    int turn = 0;
+    while(listen_fd >= 0 || n_clients)
+    {
+        struct client_t *c = NULL;
+        for(int i = 0; i < n_clients && !c; ++i)
+            if(runnable(clients[(turn + i) % n_clients]))
+            {
+                c = clients[(turn + i) % n_clients];
+                turn = (turn + i + 1) % n_clients;
+            }
+
+        struct request_t *req = c ? c->head : NULL;
+        struct framebuffer_t band;
+        int rows = 0;
+        if(req && req->error)
+        {
+            char reply[MAX_LINE];
+            append(c, reply, snprintf(reply, sizeof(reply), "error %s %s\n", req->id, req->error));
+            pop(c);
+            req = NULL;
+        }
+        else if(req)
+        {
+            int w = req->view.w;
+            if(!req->y)
+            {
+                char reply[MAX_LINE];
+                append(c, reply, snprintf(reply, sizeof(reply), "ok %s %d %d\n", req->id, w, req->view.h));
+            }
+            rows = MIN(MAX(QUANTUM / w, 1), req->view.h - req->y);
+            if((size_t)3 * w * rows > pixels_size)
+            {
+                pixels_size = (size_t)3 * w * rows;
+                pixels = realloc(pixels, pixels_size);
+            }
+            fb_wrap(&band, pixels, w, rows, (size_t)3 * w, FB_RGB24);
+            band.y0 = req->y;
+            req_opts.bounces = req->bounces;
+            render_rows(pool, &band, scene, &req->view, req->y, req->y + rows, &req_opts);
+        }
+
+        bool busy = req != NULL;
+        for(int i = 0; i < n_clients && !busy; ++i)
+            busy = runnable(clients[i]);
+        poll_clients(listen_fd, clients, &n_clients, !busy);
+
+        if(req)
+        {
+            render_wait(pool);
+            for(int y = req->y; y < req->y + rows; ++y)
+                append(c, fb_row(&band, y), 3 * band.w);
+            req->y += rows;
+            if(req->y == req->view.h)
+                pop(c);
+            flush(c);
+        }
+
+        /* only now that nothing is rendering for them can clients go */
+        for(int i = 0; i < n_clients; ++i)
+        {
+            struct client_t *d = clients[i];
+            if(!d->dead && !(d->eof && !d->head && d->out_sent == d->out_len))
+                continue;
+            while(d->head)
+                pop(d);
+            if(path)
+                close(d->in_fd);
+            free(d->out);
+            free(d);
+            clients[i--] = clients[--n_clients];
+        }
+    }
+
+    if(!path)
+    {
+        fcntl(in_fd, F_SETFL, in_flags);
+        fcntl(out_fd, F_SETFL, out_flags);
+    }
+    free(pixels);
+    return true;
+}
@@ -0,0 +1,33 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+
+#include "render.h"
+#include "scene.h"
+
+/* renders on request from a compiled scene and a running pool, for as
+ * long as there are clients. a request is one line:
+ *
+ *   render id  w h  x0 y0 x1 y1  bounces  x y z  dx dy dz  fov_x fov_y
+ *
+ * for the pixels [x0, x1) x [y0, y1) of a w x h frame, seen from x y z
+ * looking along dx dy dz with the fields of view in degrees. the
+ * reply is "ok id width height\n" followed by the region's rows as
+ * raw RGB bytes, sent as they render, or "error id message\n". a
+ * client's replies come in the order of its requests, and a client
+ * can send more while earlier ones render.
+ *
+ * every client with work waiting gets the same number of pixels in
+ * turn, so a small request waits for a slice of each big one ahead of
+ * it rather than all of it, and a client that doesn't read its
+ * replies stops getting turns rather than holding up the rest.
+ *
+ * path is a Unix socket to listen on, which runs until the process is
+ * killed, or NULL to take requests on in_fd and reply on out_fd until
+ * in_fd ends. opts gives everything but the bounces; returns false if
+ * the socket couldn't be set up */
+bool serve(const char *path, int in_fd, int out_fd, struct render_pool_t *pool,
+           const struct scene_t *scene, const struct render_opts_t *opts);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef VEC3_H
+#define VEC3_H
+
+#include <math.h>
+
+typedef float scalar;
+
+/* plain Cartesian vector for the hot path: no type tag, no conversions,
+ * and everything is inline so it folds into the intersection code */
+typedef struct vec3_t {
+    scalar x, y, z;
+} vec3;
+
+static inline vec3 vec3_make(scalar x, scalar y, scalar z)
+{
+    vec3 ret = { x, y, z };
+    return ret;
+}
+
+static inline vec3 vec3_add(vec3 a, vec3 b)
+{
+    return vec3_make(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+/* a - b */
+static inline vec3 vec3_sub(vec3 a, vec3 b)
+{
+    return vec3_make(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+static inline vec3 vec3_mul(vec3 v, scalar s)
+{
+    return vec3_make(v.x * s, v.y * s, v.z * s);
+}
+
+static inline vec3 vec3_negate(vec3 v)
+{
+    return vec3_make(-v.x, -v.y, -v.z);
+}
+
+static inline scalar vec3_dot(vec3 a, vec3 b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static inline vec3 vec3_cross(vec3 a, vec3 b)
+{
+    return vec3_make(a.y * b.z - a.z * b.y,
+                     a.z * b.x - a.x * b.z,
+                     a.x * b.y - a.y * b.x);
+}
+
+static inline scalar vec3_abs(vec3 v)
+{
+    return sqrt(vec3_dot(v, v));
+}
+
+static inline vec3 vec3_normalize(vec3 v)
+{
+    return vec3_mul(v, 1. / vec3_abs(v));
+}
+
+#endif
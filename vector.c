@@ -133,3 +133,15 @@ vector vect_cross(vector v1, vector v2)
                            v1.rect.x * v2.rect.y - v1.rect.y * v2.rect.x, } };
     return ret;
 }
+
+vec3 vect_to_vec3(vector v)
+{
+    vect_to_rect(&v);
+    return vec3_make(v.rect.x, v.rect.y, v.rect.z);
+}
+
+vector vec3_to_vect(vec3 v)
+{
+    vector ret = { RECT, { .rect = { v.x, v.y, v.z } } };
+    return ret;
+}
@@ -1,7 +1,12 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
 #include <math.h>
 
-typedef float scalar;
+#include "vec3.h"
 
+/* tagged vector, kept for the camera orientation where spherical
+ * coordinates are convenient; the renderer itself works in vec3 */
 typedef struct vector_t {
     enum { RECT, SPH } type;
     union {
@@ -28,3 +33,8 @@ void vect_to_sph(vector*);
 
 scalar vect_dot(vector v1, vector v2);
 vector vect_cross(vector v1, vector v2);
+
+vec3 vect_to_vec3(vector v);
+vector vec3_to_vect(vec3 v);
+
+#endif